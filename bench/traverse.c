@@ -0,0 +1,186 @@
+/*
+ * Times copying, comparing, printing, reading, saving, restoring and deleting
+ * large values: a chain nested depth levels deep, a cons-style list of the
+ * same length, and a wide tree. Built on the interpreter's internals, so
+ * values of any shape can be made without going through the parser.
+ *
+ * As a baseline, values shallow enough for the C stack are also copied,
+ * compared and deleted by recursive walks like the ones the work stacks
+ * replaced.
+ *
+ *   make bench && ./bench/traverse [depth] [tree-depth]
+ */
+
+#define LITHPY_NO_MAIN
+#include "../src/lithpy.c"
+
+#include <time.h>
+
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* {{{...{1}...}}} */
+lval* make_chain(long depth) {
+  lval* x = lval_num(1);
+  for (long i = 0; i < depth; i++) { x = lval_add(lval_qexpr(), x); }
+  return x;
+}
+
+/* {1 {2 {3 ... {}}}} */
+lval* make_list(long length) {
+  lval* x = lval_qexpr();
+  for (long i = length; i > 0; i--) { x = lval_add(lval_add(lval_qexpr(), lval_num(i)), x); }
+  return x;
+}
+
+/* Each level has a symbol, a string, a number and four subtrees */
+lval* make_tree(int depth) {
+  lval* x = lval_add(lval_add(lval_add(lval_sexpr(),
+    lval_sym("node")), lval_str("leaf")), lval_num(depth));
+  for (int i = 0; depth > 0 && i < 4; i++) { x = lval_add(x, make_tree(depth - 1)); }
+  return x;
+}
+
+/* Recursive baselines, handling only the types made here */
+lval* rec_copy(lval* v) {
+  lval* x = lval_alloc(v->type);
+  switch (v->type) {
+    case LVAL_NUM: x->num = v->num; break;
+    case LVAL_SYM: x->sym = strdup(v->sym); break;
+    case LVAL_STR: x->str = strdup(v->str); break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      x->count = v->count;
+      x->cell = malloc(sizeof(lval*) * x->count);
+      for (int i = 0; i < x->count; i++) { x->cell[i] = rec_copy(v->cell[i]); }
+    break;
+  }
+  return x;
+}
+
+bool rec_eq(lval* x, lval* y) {
+  if (x->type != y->type) { return false; }
+  switch (x->type) {
+    case LVAL_NUM: return x->num == y->num;
+    case LVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+    case LVAL_STR: return strcmp(x->str, y->str) == 0;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (x->count != y->count) { return false; }
+      for (int i = 0; i < x->count; i++) {
+        if (!rec_eq(x->cell[i], y->cell[i])) { return false; }
+      }
+      return true;
+  }
+  return false;
+}
+
+void rec_del(lval* v) {
+  switch (v->type) {
+    case LVAL_SYM: free(v->sym); break;
+    case LVAL_STR: free(v->str); break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) { rec_del(v->cell[i]); }
+      free(v->cell);
+    break;
+  }
+  lval_free(v);
+}
+
+void run_recursive(char* name, lval* x) {
+  double t0 = now();
+  lval* y = rec_copy(x);
+  double t1 = now();
+  bool eq = rec_eq(x, y);
+  double t2 = now();
+  rec_del(y);
+  double t3 = now();
+
+  printf("%-6s recursive copy %8.2fms  eq %8.2fms  del %8.2fms  (%s)\n",
+    "", (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t3 - t2) * 1e3, eq ? "equal" : "DIFFERENT");
+}
+
+/* Through a file, as (save) and (restore) do */
+void run_save(char* name, lval* x) {
+  char path[] = "/tmp/traverse-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) { return; }
+  close(fd);
+
+  lval* a = lval_add(lval_add(lval_sexpr(), lval_str(path)), lval_copy(x));
+  double t0 = now();
+  lval* saved = builtin_save(lcur->env, a);
+  double t1 = now();
+  lval* y = builtin_restore(lcur->env, lval_add(lval_sexpr(), lval_str(path)));
+  double t2 = now();
+  unlink(path);
+
+  printf("%-6s save %8.2fms  restore %8.2fms  (%s)\n", "", (t1 - t0) * 1e3, (t2 - t1) * 1e3,
+    saved->type == LVAL_ERR || y->type == LVAL_ERR ? "FAILED" : lval_eq(x, y) ? "equal" : "DIFFERENT");
+  lval_del(saved);
+  lval_del(y);
+}
+
+void run(char* name, lval* x, bool read) {
+  double t0 = now();
+  lval* y = lval_copy(x);
+  double t1 = now();
+  bool eq = lval_eq(x, y);
+  double t2 = now();
+  lbuf b;
+  lbuf_init(&b, NULL);
+  lval_print(&b, x);
+  double t3 = now();
+
+  /* Only shallow enough text is read back, mpc itself being recursive */
+  double parse = 0, t4 = t3, t5 = t3;
+  if (read) {
+    mpc_result_t r;
+    if (mpc_parse(name, lbuf_cstr(&b), lcur->Lispy, &r)) {
+      t4 = now();
+      lval* z = lval_read(r.output);
+      t5 = now();
+      parse = t4 - t3;
+      mpc_ast_delete(r.output);
+      lval_del(z);
+    } else {
+      mpc_err_delete(r.error);
+    }
+  }
+
+  double t6 = now();
+  lval_del(y);
+  double t7 = now();
+
+  printf("%-6s copy %8.2fms  eq %8.2fms  print %8.2fms  del %8.2fms  (%s, %zu bytes printed)\n",
+    name, (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t3 - t2) * 1e3, (t7 - t6) * 1e3,
+    eq ? "equal" : "DIFFERENT", b.len);
+  if (read) { printf("%-6s parse %7.2fms  read %8.2fms\n", "", parse * 1e3, (t5 - t4) * 1e3); }
+  lbuf_free(&b);
+
+  run_save(name, x);
+  if (read) { run_recursive(name, x); }
+  lval_del(x);
+}
+
+int main(int argc, char** argv) {
+  long depth = argc > 1 ? atol(argv[1]) : 1000000;
+  int tree = argc > 2 ? atoi(argv[2]) : 9;
+
+  lcur = lithpy_new();
+  /* Shallow enough for the recursive baseline, and run first so freeing the
+   * large values doesn't leave work for the allocator in their timings */
+  long shallow = depth < 10000 ? depth : 10000;
+  run("chain", make_chain(shallow), true);
+  run("list", make_list(shallow), true);
+
+  run("chain", make_chain(depth), false);
+  run("list", make_list(depth), false);
+  run("tree", make_tree(tree), true);
+  lithpy_delete(lcur);
+  return 0;
+}
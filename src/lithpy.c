@@ -1,8 +1,18 @@
+/* For reading the bounds of a thread's stack */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "mpc.h"
+#include "lithpy.h"
 
+#include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 #ifdef _WIN32
+#ifndef LITHPY_NO_MAIN
 
 static char buffer[2048];
 
@@ -17,108 +27,838 @@ char* readline(char* prompt) {
 
 void add_history(char* unused) {}
 
+#endif
 #else
+#ifndef LITHPY_NO_MAIN
 #include <editline/readline.h>
 
 #ifndef __APPLE__
 #include <editline/history.h>
 #endif
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#endif
+
+/* io_uring through raw system calls, so no liburing is needed */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define LURING
+#endif
+#endif
 
+#ifdef __linux__
+#include <sys/inotify.h>
 #endif
 
-/* Parser Declariations */
+/* Static tracepoints for SystemTap, perf and bpftrace, a nop when unattached */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LTRACE(...) STAP_PROBEV(lithpy, __VA_ARGS__)
+#endif
+#endif
 
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Bool;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
+#ifndef LTRACE
+#define LTRACE(...)
+#endif
 
 /* Forward Declarations */
 
 struct lval;
 struct lenv;
+struct lport;
+struct lchan;
+struct lsched;
+struct laio;
+struct lre;
+struct ljit;
+struct lheap;
+struct lheap_obj;
+struct lsource;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lport lport;
+typedef struct lchan lchan;
+typedef struct lsched lsched;
+typedef struct laio laio;
+typedef struct lre lre;
+typedef struct ljit ljit;
+typedef struct lheap lheap;
+typedef struct lheap_obj lheap_obj;
+typedef struct lsource lsource;
+
+/* Buffered I/O */
+
+#define LBUF_SIZE 65536
+
+/* Output buffer. Flushes to file when full, or grows when file is NULL */
+typedef struct {
+  FILE* file;
+  char* data;
+  size_t len;
+  size_t cap;
+} lbuf;
+
+void lbuf_init(lbuf* b, FILE* file) {
+  b->file = file;
+  b->len = 0;
+  b->cap = file ? LBUF_SIZE : 64;
+  b->data = malloc(b->cap);
+}
+
+void lbuf_flush(lbuf* b) {
+  if (b->file && b->len) {
+    fwrite(b->data, 1, b->len, b->file);
+    fflush(b->file);
+    b->len = 0;
+  }
+}
+
+void lbuf_reserve(lbuf* b, size_t n) {
+  if (b->len + n <= b->cap) { return; }
+  lbuf_flush(b);
+  while (b->len + n > b->cap) { b->cap *= 2; }
+  b->data = realloc(b->data, b->cap);
+}
+
+void lbuf_write(lbuf* b, const char* s, size_t n) {
+  /* Large writes to a file skip the buffer entirely */
+  if (b->file && n >= b->cap) {
+    lbuf_flush(b);
+    fwrite(s, 1, n, b->file);
+    return;
+  }
+  lbuf_reserve(b, n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+void lbuf_putc(lbuf* b, char c) {
+  if (b->len == b->cap) { lbuf_reserve(b, 1); }
+  b->data[b->len++] = c;
+}
+
+void lbuf_puts(lbuf* b, const char* s) { lbuf_write(b, s, strlen(s)); }
+
+void lbuf_printf(lbuf* b, const char* fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  lbuf_reserve(b, 64);
+  size_t n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, va);
+  va_end(va);
+  if (n >= b->cap - b->len) {
+    lbuf_reserve(b, n + 1);
+    va_start(va, fmt);
+    vsnprintf(b->data + b->len, b->cap - b->len, fmt, va);
+    va_end(va);
+  }
+  b->len += n;
+}
+
+/* Terminate contents as a C string, for buffers without a file */
+char* lbuf_cstr(lbuf* b) {
+  lbuf_reserve(b, 1);
+  b->data[b->len] = '\0';
+  return b->data;
+}
+
+void lbuf_free(lbuf* b) {
+  lbuf_flush(b);
+  free(b->data);
+  b->data = NULL;
+}
+
+/* Port: a shared, reference counted file handle with its own buffers */
+struct lport {
+  FILE* file;
+  int refs;
+  lbuf out;
+  char* in;
+  size_t in_pos;
+  size_t in_len;
+  size_t in_cap;
+  bool eof;
+  lport* tie;
+
+  /* Pipes, sockets and terminals, filled with whatever has arrived */
+  bool stream;
+};
+
+lport* lport_new(FILE* file) {
+  lport* p = malloc(sizeof(lport));
+  p->file = file;
+  p->refs = 1;
+  lbuf_init(&p->out, file);
+  p->in = NULL;
+  p->in_pos = 0;
+  p->in_len = 0;
+  p->in_cap = 0;
+  p->eof = false;
+  p->tie = NULL;
+  p->stream = false;
+#ifndef _WIN32
+  struct stat st;
+  if (file && fstat(fileno(file), &st) == 0) {
+    p->stream = S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || isatty(fileno(file));
+  }
+#endif
+  return p;
+}
+
+/* Read more input, keeping any unconsumed bytes. Returns bytes read */
+size_t lport_fill(lport* p) {
+  if (p->eof || !p->file) { return 0; }
+
+  /* Output on a tied port is seen before we block for input */
+  if (p->tie) { lbuf_flush(&p->tie->out); }
+
+  if (p->in_pos > 0) {
+    memmove(p->in, p->in + p->in_pos, p->in_len - p->in_pos);
+    p->in_len -= p->in_pos;
+    p->in_pos = 0;
+  }
+  if (p->in_len == p->in_cap) {
+    p->in_cap = p->in_cap ? p->in_cap * 2 : LBUF_SIZE;
+    p->in = realloc(p->in, p->in_cap);
+  }
+
+  size_t n;
+#ifndef _WIN32
+  /* fread would wait for the whole buffer, holding back complete forms */
+  if (p->stream) {
+    ssize_t r;
+    do {
+      r = read(fileno(p->file), p->in + p->in_len, p->in_cap - p->in_len);
+    } while (r < 0 && errno == EINTR);
+    n = r > 0 ? (size_t) r : 0;
+  } else
+#endif
+  n = fread(p->in + p->in_len, 1, p->in_cap - p->in_len, p->file);
+  if (n == 0) { p->eof = true; }
+  p->in_len += n;
+  return n;
+}
+
+void lport_close(lport* p) {
+  if (!p->file) { return; }
+  lbuf_flush(&p->out);
+  if (p->file != stdin && p->file != stdout && p->file != stderr) {
+    fclose(p->file);
+  }
+  p->file = NULL;
+  p->out.file = NULL;
+  p->eof = true;
+}
+
+void lport_release(lport* p) {
+  if (--p->refs > 0) { return; }
+  lport_close(p);
+  free(p->out.data);
+  free(p->in);
+  free(p);
+}
 
 /* Lisp Value */
 
 enum { LVAL_ERR, LVAL_NUM, LVAL_DEC, LVAL_SYM, LVAL_STR, LVAL_BOOL,
-       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+       LVAL_FUN, LVAL_PORT, LVAL_CHAN, LVAL_SEXPR, LVAL_QEXPR };
+
+#define LVAL_TYPES (LVAL_QEXPR + 1)
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+/*
+ * Errors keep their format and arguments and only build the message when
+ * it is printed or asked for, so errors that are caught or discarded never
+ * pay for formatting. String arguments are copied into the error itself
+ * while they fit, and freed records are kept for reuse, so raising an error
+ * usually allocates nothing beyond its value.
+ */
+
+enum { LERR_ERROR, LERR_TYPE, LERR_ARITY, LERR_UNBOUND, LERR_DIV_ZERO,
+       LERR_USER, LERR_EXIT, LERR_QUOTA, LERR_THROW };
+
+char* lerr_names[] = { "error", "type", "arity", "unbound", "division-by-zero",
+                       "user", "exit", "quota", NULL };
+
+#define LERR_MAX_ARGS 6
+#define LERR_TEXT 96
+#define LERR_SPARE 16
+
+typedef union {
+  long i;
+  double d;
+  char* s;
+} lerr_arg;
+
+typedef struct lerr lerr;
+
+struct lerr {
+  int code;
+  char* tag;
+  char* fmt;
+  char types[LERR_MAX_ARGS];
+  lerr_arg args[LERR_MAX_ARGS];
+  int count;
+  char* msg;
+  lval* payload;
+
+  /* String arguments, with a bit set for each too long for text and allocated */
+  char text[LERR_TEXT];
+  size_t text_len;
+  int owned;
+
+  /* Next spare record */
+  lerr* next;
+};
+
+/* Freed error records kept for reuse on this thread */
+_Thread_local struct {
+  lerr* list;
+  int count;
+} lerr_spare;
+
 struct lval {
   int type;
 
+  /* Allocation record, only when profiling */
+  lheap_obj* prof;
+
   /* Basic */
   long num;
   double dec;
-  char* err;
+  lerr* err;
   char* sym;
   char* str;
   char* bln;
 
   /* Function */
   lbuiltin builtin;
-  lenv* env;
   lval* formals;
   lval* body;
-
-  /* Expression */
+  lval* callee;
+  lval* opt;
+  lenv* caps;
+  lenv* scope;
+  bool macro;
+  long epoch;
+  ljit* jit;
+  long jit_epoch;
+  int refs;
+
+  /* Port */
+  lport* port;
+
+  /* Channel */
+  lchan* chan;
+
+  /* Expression, or the bound arguments of a partial application */
   int count;
   lval** cell;
 };
 
-lval* lval_num(long x) {
+/* Runtime Statistics, always counted and cheap enough to leave on. Kept per
+ * thread rather than per context, so values can be made outside of one */
+
+_Thread_local struct {
+  long allocs[LVAL_TYPES];
+  long frees[LVAL_TYPES];
+  long copies;
+  long copy_bytes;
+  long lookups;
+  long lookup_depth;
+  long calls;
+  long depth;
+  long max_depth;
+  long live;
+} lstats;
+
+/* Interpreter Context, everything that would otherwise be a global */
+
+struct lithpy {
+  mpc_parser_t* Number;
+  mpc_parser_t* Symbol;
+  mpc_parser_t* String;
+  mpc_parser_t* Bool;
+  mpc_parser_t* Comment;
+  mpc_parser_t* Sexpr;
+  mpc_parser_t* Qexpr;
+  mpc_parser_t* Expr;
+  mpc_parser_t* Lispy;
+
+  lport* in;
+  lport* out;
+  lport* err;
+  lenv* env;
+
+  /* Coroutines, created on the first spawn */
+  lsched* sched;
+
+  /* Asynchronous file requests, set up on first use */
+  laio* aio;
+
+  /* Cache of compiled regular expressions */
+  lre* re;
+
+  /* Files loaded so far, and the inotify descriptor when any are watched */
+  lsource* sources;
+  int watch_fd;
+
+  /* Live allocations when profiling, and the site new ones are tagged with */
+  lheap* heap;
+  uint32_t site;
+
+  /* Environment shared read-only between server requests, if serving */
+  lenv* shared;
+
+  /* Bumped whenever a global function is rebound, invalidating optimized bodies */
+  long epoch;
+
+  /* Number of macros defined, lambda bodies are only expanded once there are any */
+  int macros;
+
+  bool jit;
+#ifndef _WIN32
+  /* Lowest address of the stack of the thread that last evaluated */
+  pthread_t stack_thread;
+  bool stack_known;
+  uintptr_t stack_low;
+#endif
+  /* Address below which the running stack is too close to its end, 0 if unknown */
+  uintptr_t stack_limit;
+  bool exited;
+  int exit_status;
+
+  /* Limits on each top level evaluation, and what it has used so far */
+  lithpy_limits limits;
+  int breach;
+  long steps;
+  double deadline;
+
+  /* Bytes held by values in this context, and how many when the evaluation began */
+  long heap_used;
+  long heap_base;
+};
+
+/* The context running on this thread, set on entry to every API call */
+_Thread_local lithpy* lcur = NULL;
+
+/* Resource Limits */
+
+/*
+ * Breaching a limit only raises a flag, checked by the evaluator before
+ * every expression. From then on everything fails with the same error, so
+ * the program unwinds to the top level, where the next evaluation starts
+ * with a fresh budget.
+ */
+
+enum { LQUOTA_NONE, LQUOTA_HEAP, LQUOTA_STEPS, LQUOTA_DEPTH, LQUOTA_TIME, LQUOTA_STACK };
+
+/* Time is only checked every so many steps */
+#define LQUOTA_TIME_STEPS 1024
+
+/* Stack left for builtins and native code below the last checked call */
+#define LSTACK_MARGIN (1 << 16)
+
+void lquota_breach(int quota) {
+  if (!lcur->breach) { lcur->breach = quota; }
+}
+
+double lquota_now(void) {
+#ifndef _WIN32
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+#else
+  return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+bool lsched_in_task(void);
+
+/* Bottom of the running thread's stack, looked up once per thread, 0 if unknown */
+uintptr_t lstack_low(void) {
+#ifndef _WIN32
+  pthread_t self = pthread_self();
+  if (lcur->stack_known && pthread_equal(lcur->stack_thread, self)) { return lcur->stack_low; }
+
+  lcur->stack_low = 0;
+#if defined(__linux__)
+  pthread_attr_t attr;
+  if (pthread_getattr_np(self, &attr) == 0) {
+    void* addr;
+    size_t size;
+    if (pthread_attr_getstack(&attr, &addr, &size) == 0) { lcur->stack_low = (uintptr_t) addr; }
+    pthread_attr_destroy(&attr);
+  }
+#elif defined(__APPLE__)
+  lcur->stack_low = (uintptr_t) pthread_get_stackaddr_np(self) - pthread_get_stacksize_np(self);
+#endif
+  lcur->stack_thread = self;
+  lcur->stack_known = true;
+  return lcur->stack_low;
+#else
+  return 0;
+#endif
+}
+
+void lquota_start(void) {
+  /* Tasks keep the limit of their own stack, set when switching to them */
+  if (!lsched_in_task()) {
+    uintptr_t low = lstack_low();
+    lcur->stack_limit = low ? low + LSTACK_MARGIN : 0;
+  }
+  lcur->breach = LQUOTA_NONE;
+  lcur->steps = 0;
+  lcur->heap_base = lcur->heap_used;
+  lcur->deadline = lcur->limits.time_ms ? lquota_now() + lcur->limits.time_ms / 1e3 : 0;
+}
+
+/* Count a step, returning whether the evaluation must stop */
+bool lquota_step(void) {
+  lcur->steps++;
+  if (lcur->limits.steps && lcur->steps > lcur->limits.steps) { lquota_breach(LQUOTA_STEPS); }
+  if (lcur->deadline && lcur->steps % LQUOTA_TIME_STEPS == 0 && lquota_now() > lcur->deadline) {
+    lquota_breach(LQUOTA_TIME);
+  }
+  return lcur->breach != LQUOTA_NONE;
+}
+
+/* Count bytes a value takes or gives back, values are made outside of a context too */
+void lquota_heap(long bytes) {
+  if (!lcur) { return; }
+  lcur->heap_used += bytes;
+  if (lcur->limits.heap && lcur->heap_used - lcur->heap_base > lcur->limits.heap) {
+    lquota_breach(LQUOTA_HEAP);
+  }
+}
+
+/* Free a symbol or string, giving back its bytes only when limited, to spare the strlen */
+void lquota_free_text(char* s) {
+  if (lcur && lcur->limits.heap) { lquota_heap(-(long) strlen(s) - 1); }
+  free(s);
+}
+
+lheap_obj* lheap_track(void* p, bool env);
+void lheap_untrack(lheap_obj* o);
+void lenv_hold(lenv* e);
+void lenv_release(lenv* e);
+
+/* Work Stacks */
+
+/*
+ * Copying, deleting, comparing, printing and reading values walk the tree
+ * with an explicit stack rather than recursion, so how deeply values nest is
+ * limited by the heap and not the C stack. Shallow values never leave the
+ * inline items.
+ */
+
+#define LSTACK_INLINE 64
+
+typedef struct {
+  void** items;
+  size_t count;
+  size_t cap;
+  void* inline_items[LSTACK_INLINE];
+} lstack;
+
+void lstack_init(lstack* s) {
+  s->items = s->inline_items;
+  s->count = 0;
+  s->cap = LSTACK_INLINE;
+}
+
+/* Kept apart from pushing so that pushing is cheap enough to inline */
+void lstack_grow(lstack* s) {
+  s->cap *= 2;
+  if (s->items == s->inline_items) {
+    s->items = malloc(sizeof(void*) * s->cap);
+    memcpy(s->items, s->inline_items, sizeof(s->inline_items));
+  } else {
+    s->items = realloc(s->items, sizeof(void*) * s->cap);
+  }
+}
+
+void lstack_push(lstack* s, void* x) {
+  if (s->count == s->cap) { lstack_grow(s); }
+  s->items[s->count++] = x;
+}
+
+void lstack_push2(lstack* s, void* x, void* y) {
+  lstack_push(s, x);
+  lstack_push(s, y);
+}
+
+void* lstack_pop(lstack* s) { return s->items[--s->count]; }
+
+/* Reverse the groups of width items above the first from, so the first
+ * pushed is popped first */
+void lstack_reverse(lstack* s, size_t from, int width) {
+  if (s->count < from + 2 * width) { return; }
+  for (size_t a = from, b = s->count - width; a < b; a += width, b -= width) {
+    for (int i = 0; i < width; i++) {
+      void* t = s->items[a + i];
+      s->items[a + i] = s->items[b + i];
+      s->items[b + i] = t;
+    }
+  }
+}
+
+void lstack_free(lstack* s) {
+  if (s->items != s->inline_items) { free(s->items); }
+}
+
+lval* lval_alloc(int type) {
   lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  v->type = type;
+  lstats.allocs[type]++;
+  lstats.live++;
+  LTRACE(alloc, type);
+
+  /* Values are made outside of a context too */
+  v->prof = lcur && lcur->heap ? lheap_track(v, false) : NULL;
+  lquota_heap(sizeof(lval));
+  return v;
+}
+
+/* Frees v itself, once its contents have been deleted or taken */
+void lval_free(lval* v) {
+  if (v->prof) { lheap_untrack(v->prof); }
+  lstats.frees[v->type]++;
+  lstats.live--;
+  lquota_heap(-(long) sizeof(lval));
+  free(v);
+}
+
+lval* lval_num(long x) {
+  lval* v = lval_alloc(LVAL_NUM);
   v->num = x;
   return v;
 }
 
 lval* lval_dec(double x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_DEC;
+    lval* v = lval_alloc(LVAL_DEC);
     v->dec = x;
     return v;
 }
 
+lerr* lerr_new(int code) {
+  lerr* r = lerr_spare.list;
+  if (r) {
+    lerr_spare.list = r->next;
+    lerr_spare.count--;
+  } else {
+    r = malloc(sizeof(lerr));
+  }
+  r->code = code;
+  r->tag = NULL;
+  r->fmt = NULL;
+  r->count = 0;
+  r->msg = NULL;
+  r->payload = NULL;
+  r->text_len = 0;
+  r->owned = 0;
+  return r;
+}
+
+/* Copy s in as argument i, inside the error when there's room */
+void lerr_keep(lerr* r, int i, const char* s) {
+  size_t n = strlen(s) + 1;
+  if (r->text_len + n > LERR_TEXT) {
+    r->args[i].s = strdup(s);
+    r->owned |= 1 << i;
+    return;
+  }
+  r->args[i].s = memcpy(r->text + r->text_len, s, n);
+  r->text_len += n;
+}
+
+/* Frees everything but the payload, which the caller deals with */
+void lerr_free(lerr* r) {
+  for (int i = 0; i < r->count; i++) {
+    if (r->owned & (1 << i)) { free(r->args[i].s); }
+  }
+  free(r->tag);
+  free(r->msg);
+
+  if (lerr_spare.count < LERR_SPARE) {
+    r->next = lerr_spare.list;
+    lerr_spare.list = r;
+    lerr_spare.count++;
+  } else {
+    free(r);
+  }
+}
+
+void lerr_free_spare(void) {
+  while (lerr_spare.list) {
+    lerr* r = lerr_spare.list;
+    lerr_spare.list = r->next;
+    free(r);
+  }
+  lerr_spare.count = 0;
+}
+
+/* Copy of r without its payload */
+lerr* lerr_copy(lerr* r) {
+  lerr* x = lerr_new(r->code);
+  x->fmt = r->fmt;
+  x->count = r->count;
+  memcpy(x->types, r->types, sizeof(r->types));
+  memcpy(x->args, r->args, sizeof(r->args));
+  for (int i = 0; i < r->count; i++) {
+    if (r->types[i] == 's') { lerr_keep(x, i, r->args[i].s); }
+  }
+  if (r->tag) { x->tag = strdup(r->tag); }
+  if (r->msg) { x->msg = strdup(r->msg); }
+  return x;
+}
+
+/* Format must be a literal using only %s, %c, %d, %i, %li and %f */
+lval* lval_verr(int code, char* fmt, va_list va) {
+  lval* v = lval_alloc(LVAL_ERR);
+  v->err = lerr_new(code);
+  v->err->fmt = fmt;
+
+  for (char* c = fmt; *c; c++) {
+    if (*c != '%') { continue; }
+    c += strspn(c + 1, "-+ #0123456789.") + 1;
+    if (*c == '%') { continue; }
+
+    bool l = false;
+    if (*c == 'l') { l = true; c++; }
+
+    lerr* r = v->err;
+    if (r->count == LERR_MAX_ARGS) { break; }
+    r->types[r->count] = *c;
+    switch (*c) {
+      case 's': lerr_keep(r, r->count, va_arg(va, char*)); break;
+      case 'f': r->args[r->count].d = va_arg(va, double); break;
+      default:  r->args[r->count].i = l ? va_arg(va, long) : va_arg(va, int); break;
+    }
+    r->count++;
+  }
+
+  return v;
+}
+
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
   va_list va;
   va_start(va, fmt);
-  v->err = malloc(512);
-  vsnprintf(v->err, 511, fmt, va);
-  v->err = realloc(v->err, strlen(v->err)+1);
+  lval* v = lval_verr(LERR_ERROR, fmt, va);
+  va_end(va);
+  return v;
+}
+
+lval* lval_err_code(int code, char* fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  lval* v = lval_verr(code, fmt, va);
   va_end(va);
   return v;
 }
 
+lval* lquota_err(void) {
+  lithpy_limits* l = &lcur->limits;
+  switch (lcur->breach) {
+    case LQUOTA_HEAP: return lval_err_code(LERR_QUOTA, "Heap limit of %li bytes exceeded", l->heap);
+    case LQUOTA_STEPS: return lval_err_code(LERR_QUOTA, "Step limit of %li exceeded", l->steps);
+    case LQUOTA_DEPTH: return lval_err_code(LERR_QUOTA, "Depth limit of %li exceeded", l->depth);
+    case LQUOTA_STACK: return lval_err_code(LERR_QUOTA, "Stack exhausted by nested calls");
+  }
+  return lval_err_code(LERR_QUOTA, "Time limit of %li ms exceeded", l->time_ms);
+}
+
+/* Errors raised from Lisp carry a value instead of a format */
+lval* lval_err_user(char* tag, char* msg, lval* payload) {
+  lval* v = lval_alloc(LVAL_ERR);
+  v->err = lerr_new(tag ? LERR_THROW : LERR_USER);
+  v->err->tag = tag ? strdup(tag) : NULL;
+  v->err->msg = strdup(msg);
+  v->err->payload = payload;
+  return v;
+}
+
+char* lerr_code_name(lerr* r) {
+  return r->tag ? r->tag : lerr_names[r->code];
+}
+
+char* lerr_message(lerr* r) {
+  if (r->msg) { return r->msg; }
+
+  lbuf b;
+  lbuf_init(&b, NULL);
+  char spec[32];
+  int n = 0;
+
+  for (char* c = r->fmt; *c; c++) {
+    if (*c != '%') { lbuf_putc(&b, *c); continue; }
+    char* start = c;
+    c += strspn(c + 1, "-+ #0123456789.") + 1;
+    if (*c == '%') { lbuf_putc(&b, '%'); continue; }
+    if (*c == 'l') { c++; }
+    if (n == r->count) { break; }
+
+    size_t len = c - start + 1;
+    if (len >= sizeof(spec)) { len = sizeof(spec) - 1; }
+    memcpy(spec, start, len);
+    spec[len] = '\0';
+
+    switch (r->types[n]) {
+      case 's': lbuf_printf(&b, spec, r->args[n].s); break;
+      case 'f': lbuf_printf(&b, spec, r->args[n].d); break;
+      default:
+        if (spec[len-2] == 'l') {
+          lbuf_printf(&b, spec, r->args[n].i);
+        } else {
+          lbuf_printf(&b, spec, (int) r->args[n].i);
+        }
+      break;
+    }
+    n++;
+  }
+
+  r->msg = lbuf_cstr(&b);
+  return r->msg;
+}
+
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
+  lval* v = lval_alloc(LVAL_SYM);
   v->sym = malloc(strlen(s) + 1);
   strcpy(v->sym, s);
+  lquota_heap(strlen(s) + 1);
   return v;
 }
 
-lval* lval_str(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+lval* lval_strn(char* s, size_t n) {
+  lval* v = lval_alloc(LVAL_STR);
+  v->str = malloc(n + 1);
+  memcpy(v->str, s, n);
+  v->str[n] = '\0';
+  lquota_heap(n + 1);
   return v;
 }
 
+lval* lval_str(char* s) {
+  return lval_strn(s, strlen(s));
+}
+
 lval* lval_bln(bool x) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_BOOL;
+  lval* v = lval_alloc(LVAL_BOOL);
 
   if (x == 1) {
     v->bln = "true";
@@ -131,113 +871,252 @@ lval* lval_bln(bool x) {
 }
 
 lval* lval_builtin(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_alloc(LVAL_FUN);
   v->builtin = func;
   return v;
 }
 
-lenv* lenv_new(void);
+/* Takes ownership of one reference to the port */
+lval* lval_port(lport* p) {
+  lval* v = lval_alloc(LVAL_PORT);
+  v->port = p;
+  return v;
+}
+
+/* Takes ownership of one reference to the channel */
+lval* lval_chan(lchan* c) {
+  lval* v = lval_alloc(LVAL_CHAN);
+  v->chan = c;
+  return v;
+}
 
+/* Lambdas and partial applications are immutable and shared by reference */
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_alloc(LVAL_FUN);
   v->builtin = NULL;
-  v->env = lenv_new();
   v->formals = formals;
   v->body = body;
+  v->callee = NULL;
+  v->opt = NULL;
+  v->caps = NULL;
+  v->scope = NULL;
+  v->macro = false;
+  v->epoch = -1;
+  v->jit = NULL;
+  v->jit_epoch = -1;
+  v->refs = 1;
+  return v;
+}
+
+/* Binds the arguments in a to f, taking a reference to f */
+lval* lval_partial(lval* f, lval* a) {
+  lval* v = lval_alloc(LVAL_FUN);
+  v->builtin = NULL;
+  v->formals = NULL;
+  v->body = NULL;
+  v->callee = f;
+  v->opt = NULL;
+  v->caps = NULL;
+  v->scope = NULL;
+  v->macro = false;
+  v->jit = NULL;
+  v->refs = 1;
+  v->count = a->count;
+  v->cell = a->cell;
+  f->refs++;
+  if (f->scope) { lenv_hold(f->scope); }
+  lval_free(a);
   return v;
 }
 
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval* v = lval_alloc(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
 }
 
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval* v = lval_alloc(LVAL_QEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
 }
 
+void ljit_free(lval* f);
 void lenv_del(lenv* e);
+bool lenv_eq(lenv* x, lenv* y);
+lchan* lchan_ref(lchan* c);
+void lchan_release(lchan* c);
 
-void lval_del(lval* v) {
-
+/* Frees numbers, symbols and other values without children, false for the rest */
+bool lval_del_atom(lval* v) {
   switch (v->type) {
     case LVAL_BOOL:
     case LVAL_NUM:
     case LVAL_DEC: break;
-    case LVAL_FUN:
-      if (!v->builtin) {
-        lenv_del(v->env);
-        lval_del(v->formals);
-        lval_del(v->body);
-      }
-    break;
-    case LVAL_ERR: free(v->err); break;
-    case LVAL_SYM: free(v->sym); break;
-    case LVAL_STR: free(v->str); break;
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-      for (int i = 0; i < v->count; i++) {
-        lval_del(v->cell[i]);
+    case LVAL_SYM: lquota_free_text(v->sym); break;
+    case LVAL_STR: lquota_free_text(v->str); break;
+    default: return false;
+  }
+  lval_free(v);
+  return true;
+}
+
+/* Whether v is a list of atoms alone, such as a leaf of a tree, which the
+ * walks finish in place rather than stacking */
+bool lval_flat(lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return false; }
+  for (int i = 0; i < v->count; i++) {
+    switch (v->cell[i]->type) {
+      case LVAL_BOOL:
+      case LVAL_NUM:
+      case LVAL_DEC:
+      case LVAL_SYM:
+      case LVAL_STR: break;
+      default: return false;
+    }
+  }
+  return true;
+}
+
+void lval_del(lval* v) {
+  if (lval_del_atom(v)) { return; }
+
+  lstack s;
+  lstack_init(&s);
+
+  /* Children are pushed as each value is freed, and deleted in turn */
+  for (; v; v = s.count ? lstack_pop(&s) : NULL) {
+    switch (v->type) {
+      case LVAL_BOOL:
+      case LVAL_NUM:
+      case LVAL_DEC: break;
+      case LVAL_FUN:
+        if (v->builtin) { break; }
+        if (--v->refs > 0) {
+          if (v->scope) { lenv_release(v->scope); }
+          continue;
+        }
+        if (v->callee) {
+          lstack_push(&s, v->callee);
+          for (int i = 0; i < v->count; i++) { lstack_push(&s, v->cell[i]); }
+          lquota_heap(-(long) sizeof(lval*) * v->count);
+          free(v->cell);
+        } else {
+          lstack_push(&s, v->formals);
+          lstack_push(&s, v->body);
+          if (v->opt) { lstack_push(&s, v->opt); }
+          if (v->caps) { lenv_del(v->caps); }
+          if (v->scope) { lenv_release(v->scope); }
+          ljit_free(v);
+        }
+      break;
+      case LVAL_PORT: lport_release(v->port); break;
+      case LVAL_CHAN: lchan_release(v->chan); break;
+      case LVAL_ERR:
+        if (v->err->payload) { lstack_push(&s, v->err->payload); }
+        lerr_free(v->err);
+      break;
+      case LVAL_SYM: lquota_free_text(v->sym); break;
+      case LVAL_STR: lquota_free_text(v->str); break;
+      case LVAL_QEXPR:
+      case LVAL_SEXPR: {
+        /* Freed in order, which suits the allocator best: atoms and flat
+         * lists here, the rest pushed and then reversed */
+        size_t from = s.count;
+        for (int i = 0; i < v->count; i++) {
+          lval* c = v->cell[i];
+          if (lval_del_atom(c)) { continue; }
+          if (!lval_flat(c)) { lstack_push(&s, c); continue; }
+          for (int j = 0; j < c->count; j++) { lval_del_atom(c->cell[j]); }
+          lquota_heap(-(long) sizeof(lval*) * c->count);
+          free(c->cell);
+          lval_free(c);
+        }
+        lstack_reverse(&s, from, 1);
+        lquota_heap(-(long) sizeof(lval*) * v->count);
+        free(v->cell);
       }
-      free(v->cell);
-    break;
+      break;
+    }
+
+    lval_free(v);
   }
 
-  free(v);
+  lstack_free(&s);
 }
 
-lenv* lenv_copy(lenv* e);
+/* Copy of v alone, pushing its children and the slots to copy them into */
+lval* lval_copy_one(lval* v, lstack* s) {
+  if (v->type == LVAL_FUN && !v->builtin) {
+    v->refs++;
+    if (v->scope) { lenv_hold(v->scope); }
+    return v;
+  }
 
-lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+  lval* x = lval_alloc(v->type);
+  lstats.copies++;
+  lstats.copy_bytes += sizeof(lval);
   switch (v->type) {
-    case LVAL_FUN:
-      if (v->builtin) {
-        x->builtin = v->builtin;
-      } else {
-        x->builtin = NULL;
-        x->env = lenv_copy(v->env);
-        x->formals = lval_copy(v->formals);
-        x->body = lval_copy(v->body);
-      }
-    break;
+    case LVAL_FUN: x->builtin = v->builtin; break;
     case LVAL_BOOL: x->bln = v->bln; break;
     case LVAL_NUM: x->num = v->num; break;
-    case LVAL_ERR: x->err = malloc(strlen(v->err) + 1);
-      strcpy(x->err, v->err);
+    case LVAL_DEC: x->dec = v->dec; break;
+    case LVAL_PORT: x->port = v->port; x->port->refs++; break;
+    case LVAL_CHAN: x->chan = lchan_ref(v->chan); break;
+    case LVAL_ERR:
+      x->err = lerr_copy(v->err);
+      if (v->err->payload) { lstack_push2(s, v->err->payload, &x->err->payload); }
     break;
     case LVAL_SYM: x->sym = malloc(strlen(v->sym) + 1);
       strcpy(x->sym, v->sym);
+      lstats.copy_bytes += strlen(v->sym) + 1;
+      lquota_heap(strlen(v->sym) + 1);
     break;
     case LVAL_STR: x->str = malloc(strlen(v->str) + 1);
       strcpy(x->str, v->str);
+      lstats.copy_bytes += strlen(v->str) + 1;
+      lquota_heap(strlen(v->str) + 1);
     break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
       x->cell = malloc(sizeof(lval*) * x->count);
-      for (int i = 0; i < x->count; i++) {
-        x->cell[i] = lval_copy(v->cell[i]);
+      lstats.copy_bytes += sizeof(lval*) * x->count;
+      lquota_heap(sizeof(lval*) * x->count);
+      /* Only nested expressions wait on the stack */
+      for (int i = x->count - 1; i >= 0; i--) {
+        lval* c = v->cell[i];
+        if (c->type == LVAL_SEXPR || c->type == LVAL_QEXPR) {
+          lstack_push2(s, c, &x->cell[i]);
+        } else {
+          x->cell[i] = lval_copy_one(c, s);
+        }
       }
     break;
   }
   return x;
 }
 
+lval* lval_copy(lval* v) {
+  lstack s;
+  lstack_init(&s);
+  lval* x = lval_copy_one(v, &s);
+  while (s.count) {
+    lval** slot = lstack_pop(&s);
+    lval* child = lstack_pop(&s);
+    *slot = lval_copy_one(child, &s);
+  }
+  lstack_free(&s);
+  return x;
+}
+
 lval* lval_add(lval* v, lval* x) {
   v->count++;
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   v->cell[v->count-1] = x;
+  lquota_heap(sizeof(lval*));
   return v;
 }
 
@@ -245,8 +1124,9 @@ lval* lval_join(lval* x, lval* y) {
   for (int i = 0; i < y->count; i++) {
     x = lval_add(x, y->cell[i]);
   }
+  lquota_heap(-(long) sizeof(lval*) * y->count);
   free(y->cell);
-  free(y);
+  lval_free(y);
   return x;
 }
 
@@ -256,6 +1136,7 @@ lval* lval_pop(lval* v, int i) {
     &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
   v->count--;
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  lquota_heap(-(long) sizeof(lval*));
   return x;
 }
 
@@ -265,90 +1146,171 @@ lval* lval_take(lval* v, int i) {
   return x;
 }
 
-void lval_print(lval* v);
+/* Items printed inside an expression, application or lambda, and their brackets */
+int lval_print_count(lval* v) {
+  if (v->type == LVAL_FUN) { return v->callee ? v->count + 1 : 2; }
+  return v->count;
+}
 
-void lval_print_expr(lval* v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
-    if (i != (v->count-1)) {
-      putchar(' ');
-    }
-  }
-  putchar(close);
+lval* lval_print_item(lval* v, int i) {
+  if (v->type != LVAL_FUN) { return v->cell[i]; }
+  if (v->callee) { return i == 0 ? v->callee : v->cell[i-1]; }
+  return i == 0 ? v->formals : v->body;
 }
 
-void lval_print_str(lval* v) {
-  /* Make a Copy of the string */
-  char* escaped = malloc(strlen(v->str)+1);
-  strcpy(escaped, v->str);
-  /* Pass it through the escape function */
-  escaped = mpcf_escape(escaped);
-  /* Print it between " characters */
-  printf("\"%s\"", escaped);
-  /* free the copied string */
-  free(escaped);
+char* lval_print_open(lval* v) {
+  if (v->type == LVAL_QEXPR) { return "{"; }
+  if (v->type == LVAL_FUN && !v->callee) { return "(\\ "; }
+  return "(";
 }
 
-void lval_print(lval* v) {
-  switch (v->type) {
-    case LVAL_FUN:
-      if (v->builtin) {
-        printf("<builtin>");
-      } else {
-        printf("(\\ ");
-        lval_print(v->formals);
-        putchar(' ');
-        lval_print(v->body);
-        putchar(')');
-      }
-    break;
-    case LVAL_BOOL:  printf("%s", v->bln); break;
-    case LVAL_NUM:   printf("%li", v->num); break;
-    case LVAL_DEC:   printf("%.2f", v->dec); break;
-    case LVAL_ERR:   printf("Error: %s", v->err); break;
-    case LVAL_SYM:   printf("%s", v->sym); break;
-    case LVAL_STR:   lval_print_str(v); break;
-    case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
+void lval_print_str(lbuf* b, lval* v) {
+  /* Escape straight into the buffer, using the same escapes as mpcf_escape */
+  lbuf_putc(b, '"');
+  for (char* c = v->str; *c; c++) {
+    switch (*c) {
+      case '\a':  lbuf_write(b, "\\a", 2); break;
+      case '\b':  lbuf_write(b, "\\b", 2); break;
+      case '\f':  lbuf_write(b, "\\f", 2); break;
+      case '\n':  lbuf_write(b, "\\n", 2); break;
+      case '\r':  lbuf_write(b, "\\r", 2); break;
+      case '\t':  lbuf_write(b, "\\t", 2); break;
+      case '\v':  lbuf_write(b, "\\v", 2); break;
+      case '\\':  lbuf_write(b, "\\\\", 2); break;
+      case '\'':  lbuf_write(b, "\\'", 2); break;
+      case '"':  lbuf_write(b, "\\\"", 2); break;
+      default:   lbuf_putc(b, *c); break;
+    }
   }
+  lbuf_putc(b, '"');
 }
 
-void lval_println(lval* v) { lval_print(v); putchar('\n'); }
-
-lval* lval_eq(lval* x, lval* y) {
+void lval_print(lbuf* b, lval* v) {
+  /* Each open value is pushed with the index of its next item */
+  lstack s;
+  lstack_init(&s);
+
+  while (v) {
+    switch (v->type) {
+      case LVAL_FUN:
+        if (v->builtin) { lbuf_puts(b, "<builtin>"); break; }
+        /* Applications are printed as the call they stand for */
+        lbuf_puts(b, lval_print_open(v));
+        lstack_push2(&s, v, (void*) 0);
+      break;
+      case LVAL_PORT:  lbuf_puts(b, "<port>"); break;
+      case LVAL_CHAN:  lbuf_puts(b, "<channel>"); break;
+      case LVAL_BOOL:  lbuf_puts(b, v->bln); break;
+      case LVAL_NUM:   lbuf_printf(b, "%li", v->num); break;
+      case LVAL_DEC:   lbuf_printf(b, "%.2f", v->dec); break;
+      case LVAL_ERR:   lbuf_puts(b, "Error: "); lbuf_puts(b, lerr_message(v->err)); break;
+      case LVAL_SYM:   lbuf_puts(b, v->sym); break;
+      case LVAL_STR:   lval_print_str(b, v); break;
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+        lbuf_puts(b, lval_print_open(v));
+        lstack_push2(&s, v, (void*) 0);
+      break;
+    }
 
-  if (x->type != y->type) { return lval_bln(false); }
+    /* Move on to the next item, closing the values that have run out */
+    v = NULL;
+    while (!v && s.count) {
+      lval* open = s.items[s.count-2];
+      intptr_t i = (intptr_t) s.items[s.count-1];
+      if (i < lval_print_count(open)) {
+        if (i > 0) { lbuf_putc(b, ' '); }
+        s.items[s.count-1] = (void*) (i + 1);
+        v = lval_print_item(open, i);
+      } else {
+        lbuf_putc(b, open->type == LVAL_QEXPR ? '}' : ')');
+        s.count -= 2;
+      }
+    }
+  }
+
+  lstack_free(&s);
+}
+
+void lval_println(lval* v) { lval_print(&lcur->out->out, v); lbuf_putc(&lcur->out->out, '\n'); }
+
+/* Compares x and y if x is an atom, giving -1 if it isn't */
+int lval_eq_atom(lval* x, lval* y) {
+  switch (x->type) {
+    case LVAL_BOOL: return y->type == LVAL_BOOL && x->bln == y->bln;
+    case LVAL_NUM: return y->type == LVAL_NUM && x->num == y->num;
+    case LVAL_DEC: return y->type == LVAL_DEC && x->dec == y->dec;
+    case LVAL_SYM: return y->type == LVAL_SYM && strcmp(x->sym, y->sym) == 0;
+    case LVAL_STR: return y->type == LVAL_STR && strcmp(x->str, y->str) == 0;
+    default: return -1;
+  }
+}
+
+/* Compares x and y alone, pushing pairs of nested expressions to compare after */
+bool lval_eq_one(lval* x, lval* y, lstack* s) {
+  int atom = lval_eq_atom(x, y);
+  if (atom >= 0) { return atom; }
+  if (x->type != y->type) { return false; }
 
   switch (x->type) {
-    case LVAL_BOOL: return lval_bln(x->bln == y->bln);
-    case LVAL_NUM: return lval_bln(x->num == y->num);
-    case LVAL_ERR: return lval_bln(strcmp(x->err, y->err) == 0);
-    case LVAL_SYM: return lval_bln(strcmp(x->sym, y->sym) == 0);
-    case LVAL_STR: return lval_bln(strcmp(x->str, y->str) == 0);
+    case LVAL_ERR:
+      return strcmp(lerr_code_name(x->err), lerr_code_name(y->err)) == 0
+        && strcmp(lerr_message(x->err), lerr_message(y->err)) == 0;
+    case LVAL_PORT: return x->port == y->port;
+    case LVAL_CHAN: return x->chan == y->chan;
     case LVAL_FUN:
-      if (x->builtin || y->builtin) {
-        return lval_bln(x->builtin == y->builtin);
-      } else {
-        return lval_bln(lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body));
-      }
+      if (x->builtin || y->builtin) { return x->builtin == y->builtin; }
+      if (x->callee || y->callee) { return x == y; }
+      lstack_push2(s, x->formals, y->formals);
+      lstack_push2(s, x->body, y->body);
+      return x->macro == y->macro && x->scope == y->scope && lenv_eq(x->caps, y->caps);
     case LVAL_QEXPR:
-    case LVAL_SEXPR:
-      if (x->count != y->count) { return lval_bln(false); }
+    case LVAL_SEXPR: {
+      if (x->count != y->count) { return false; }
+      /* Compared in order: atoms and flat lists here, the rest pushed and
+       * then reversed */
+      size_t from = s->count;
       for (int i = 0; i < x->count; i++) {
-        if (!lval_eq(x->cell[i], y->cell[i])) { return lval_bln(false); }
+        lval* xc = x->cell[i];
+        lval* yc = y->cell[i];
+        int atom = lval_eq_atom(xc, yc);
+        if (atom == 0) { return false; }
+        if (atom == 1) { continue; }
+        if (!lval_flat(xc)) { lstack_push2(s, xc, yc); continue; }
+        if (yc->type != xc->type || yc->count != xc->count) { return false; }
+        for (int j = 0; j < xc->count; j++) {
+          if (!lval_eq_atom(xc->cell[j], yc->cell[j])) { return false; }
+        }
       }
-      return lval_bln(true);
-    break;
+      lstack_reverse(s, from, 2);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Stops at the first difference */
+bool lval_eq(lval* x, lval* y) {
+  lstack s;
+  lstack_init(&s);
+  bool eq = lval_eq_one(x, y, &s);
+  while (eq && s.count) {
+    y = lstack_pop(&s);
+    x = lstack_pop(&s);
+    eq = lval_eq_one(x, y, &s);
   }
-  return lval_bln(false);
+  lstack_free(&s);
+  return eq;
 }
 
 char* ltype_name(int t) {
   switch(t) {
     case LVAL_BOOL: return "Boolean";
     case LVAL_FUN: return "Function";
+    case LVAL_PORT: return "Port";
+    case LVAL_CHAN: return "Channel";
     case LVAL_NUM: return "Number";
+    case LVAL_DEC: return "Decimal";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_STR: return "String";
@@ -361,34 +1323,73 @@ char* ltype_name(int t) {
 /* Lisp Environment */
 
 struct lenv {
+  lheap_obj* prof;
   lenv* par;
   int count;
   char** syms;
   lval** vals;
+
+  /* Variables captured by the function this is a call of, searched after ours */
+  lenv* caps;
+
+  /* Frame that function was made in, searched after the globals */
+  lenv* scope;
+
+  /* Held by the running call, by lambdas made here and by frames within it */
+  int refs;
+
+  /* Once the call returns, how many of those references its own bindings hold */
+  int internal;
+  bool closed;
+
+  /* What a frame outliving its call keeps alive: the function, or the enclosing frame */
+  lval* fn;
+  lenv* up;
 };
 
 lenv* lenv_new(void) {
   lenv* e = malloc(sizeof(lenv));
+  e->prof = lcur && lcur->heap ? lheap_track(e, true) : NULL;
   e->par = NULL;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
+  e->caps = NULL;
+  e->scope = NULL;
+  e->refs = 1;
+  e->internal = 0;
+  e->closed = false;
+  e->fn = NULL;
+  e->up = NULL;
   return e;
 }
 
 void lenv_del(lenv* e) {
+  /* Releases made while the bindings go can't free it again */
+  e->closed = false;
   for (int i = 0; i < e->count; i++) {
     free(e->syms[i]);
     lval_del(e->vals[i]);
   }
   free(e->syms);
   free(e->vals);
+  if (e->fn) { lval_del(e->fn); }
+  if (e->up) { lenv_release(e->up); }
+  if (e->prof) { lheap_untrack(e->prof); }
   free(e);
 }
 
 lenv* lenv_copy(lenv* e) {
   lenv* n = malloc(sizeof(lenv));
+  n->prof = lcur && lcur->heap ? lheap_track(n, true) : NULL;
   n->par = e->par;
+  n->caps = e->caps;
+  n->scope = e->scope;
+  n->refs = 1;
+  n->internal = 0;
+  n->closed = false;
+  n->fn = NULL;
+  n->up = NULL;
   n->count = e->count;
   n->syms = malloc(sizeof(char*) * n->count);
   n->vals = malloc(sizeof(lval*) * n->count);
@@ -400,21 +1401,77 @@ lenv* lenv_copy(lenv* e) {
   return n;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-
+/* Value bound to sym in e itself or its captures, NULL if none */
+lval* lenv_here(lenv* e, char* sym) {
   for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) { return lval_copy(e->vals[i]); }
+    if (strcmp(e->syms[i], sym) == 0) { return e->vals[i]; }
   }
+  if (!e->caps) { return NULL; }
+  for (int i = 0; i < e->caps->count; i++) {
+    if (strcmp(e->caps->syms[i], sym) == 0) { return e->caps->vals[i]; }
+  }
+  return NULL;
+}
 
-  if (e->par) {
-    return lenv_get(e->par, k);
-  } else {
-    return lval_err("Unbound Symbol '%s'", k->sym);
+bool lenv_eq(lenv* x, lenv* y) {
+  if (!x || !y) { return x == y; }
+  if (x->count != y->count) { return false; }
+  for (int i = 0; i < x->count; i++) {
+    if (strcmp(x->syms[i], y->syms[i]) != 0 || !lval_eq(x->vals[i], y->vals[i])) { return false; }
+  }
+  return true;
+}
+
+lval* lenv_lookup(lenv* e, char* sym);
+
+/* Binding of sym in the frame the running function was made in, if any */
+lval* lenv_scoped(lenv* e, char* sym) {
+  for (; e; e = e->par) {
+    if (e->scope) { return lenv_lookup(e->scope, sym); }
+  }
+  return NULL;
+}
+
+/* Borrowed lookup done by the evaluator, counted in the statistics */
+lval* lenv_find(lenv* e, char* sym) {
+  lstats.lookups++;
+
+  for (lenv* s = e; s; s = s->par) {
+    lval* x = lenv_here(s, sym);
+    if (x) { return x; }
+    lstats.lookup_depth++;
+  }
+  return lenv_scoped(e, sym);
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+  lval* x = lenv_find(e, k->sym);
+  if (x) { return lval_copy(x); }
+  return lval_err_code(LERR_UNBOUND, "Unbound Symbol '%s'", k->sym);
+}
+
+/* Borrowed lookup without copying, NULL if unbound */
+lval* lenv_lookup(lenv* e, char* sym) {
+  for (lenv* s = e; s; s = s->par) {
+    lval* x = lenv_here(s, sym);
+    if (x) { return x; }
   }
+  return lenv_scoped(e, sym);
+}
+
+/* Outermost environment definitions go into, stopping short of the shared one */
+lenv* lenv_top(lenv* e) {
+  while (e->par && e->par != lcur->shared) { e = e->par; }
+  return e;
 }
 
 void lenv_put(lenv* e, lval* k, lval* v) {
 
+  if (!e->par || e->par == lcur->shared) {
+    lval* old = lenv_lookup(e, k->sym);
+    if (old && old->type == LVAL_FUN) { lcur->epoch++; }
+  }
+
   for (int i = 0; i < e->count; i++) {
     if (strcmp(e->syms[i], k->sym) == 0) {
       lval_del(e->vals[i]);
@@ -431,23 +1488,168 @@ void lenv_put(lenv* e, lval* k, lval* v) {
   strcpy(e->syms[e->count-1], k->sym);
 }
 
+/* Like lenv_put, but takes ownership of v rather than copying it */
+void lenv_bind(lenv* e, lval* k, lval* v) {
+
+  for (int i = 0; i < e->count; i++) {
+    if (strcmp(e->syms[i], k->sym) == 0) {
+      lval_del(e->vals[i]);
+      e->vals[i] = v;
+      return;
+    }
+  }
+
+  e->count++;
+  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+  e->syms = realloc(e->syms, sizeof(char*) * e->count);
+  e->vals[e->count-1] = v;
+  e->syms[e->count-1] = malloc(strlen(k->sym)+1);
+  strcpy(e->syms[e->count-1], k->sym);
+}
+
 void lenv_def(lenv* e, lval* k, lval* v) {
-  while (e->par) { e = e->par; }
-  lenv_put(e, k, v);
+  lenv_put(lenv_top(e), k, v);
+}
+
+/*
+ * Closures capture the free variables of their body that are bound in a
+ * local scope when they are made, copying them into a flat environment of
+ * their own. Everything else is looked up in the global environment, so a
+ * function sees the same bindings wherever it is called from.
+ *
+ * A name bound nowhere yet, such as that of a local helper calling itself,
+ * is looked up last in the frame the lambda was made in. The lambda keeps
+ * that frame alive, so a frame can outlive its call. Its bindings can't
+ * change after that, so it is freed once every reference left to it comes
+ * from lambdas it holds itself.
+ */
+
+/* Binding of sym in a scope below top, captures included */
+lval* lenv_local(lenv* e, lenv* top, char* sym) {
+  for (; e && e != top; e = e->par) {
+    lval* x = lenv_here(e, sym);
+    if (x) { return x; }
+  }
+  return NULL;
+}
+
+/* Captures f's free variables bound in e, returning whether any is bound nowhere */
+bool lenv_capture_syms(lenv* e, lenv* top, lval* formals, lval* body, lenv** caps) {
+  bool unbound = false;
+  lstack s;
+  lstack_init(&s);
+
+  /* Children are pushed last first, so symbols are met in order */
+  for (lval* v = body; v; v = s.count ? lstack_pop(&s) : NULL) {
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+      for (int i = v->count - 1; i >= 0; i--) { lstack_push(&s, v->cell[i]); }
+      continue;
+    }
+    if (v->type != LVAL_SYM) { continue; }
+
+    bool formal = false;
+    for (int i = 0; i < formals->count && !formal; i++) {
+      formal = strcmp(formals->cell[i]->sym, v->sym) == 0;
+    }
+    if (formal || (*caps && lenv_here(*caps, v->sym))) { continue; }
+    lval* x = lenv_local(e, top, v->sym);
+    if (!x) {
+      if (!lenv_lookup(top, v->sym)) { unbound = true; }
+      continue;
+    }
+    if (!*caps) { *caps = lenv_new(); }
+    lenv_bind(*caps, v, lval_copy(x));
+  }
+
+  lstack_free(&s);
+  return unbound;
+}
+
+/* Set the captures of lambda f made in e, and the frame it may look in later */
+void lenv_capture(lenv* e, lval* f) {
+  lenv* top = lenv_top(e);
+  if (e == top) { return; }
+  if (lenv_capture_syms(e, top, f->formals, f->body, &f->caps)) {
+    f->scope = e;
+    e->refs += f->refs;
+  }
+}
+
+void lenv_hold(lenv* e) { e->refs++; }
+
+/* Drop a reference to a frame, freeing it if only its own bindings still hold it */
+void lenv_release(lenv* e) {
+  e->refs--;
+  if (e->closed && e->refs == e->internal) { lenv_del(e); }
+}
+
+/* References to lambdas made in e from its bindings, directly or through functions they hold */
+int lenv_internal(lenv* e) {
+  int n = 0;
+  lstack s, seen;
+  lstack_init(&s);
+  lstack_init(&seen);
+  for (int i = 0; i < e->count; i++) { lstack_push(&s, e->vals[i]); }
+
+  while (s.count) {
+    lval* v = lstack_pop(&s);
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+      for (int i = 0; i < v->count; i++) { lstack_push(&s, v->cell[i]); }
+      continue;
+    }
+    if (v->type != LVAL_FUN || v->builtin) { continue; }
+
+    if (v->scope == e) { n++; }
+    bool met = false;
+    for (int i = 0; i < seen.count && !met; i++) { met = seen.items[i] == v; }
+    if (met) { continue; }
+    lstack_push(&seen, v);
+    if (v->callee) {
+      /* A partial holds its function and arguments */
+      lstack_push(&s, v->callee);
+      for (int i = 0; i < v->count; i++) { lstack_push(&s, v->cell[i]); }
+      continue;
+    }
+    for (int i = 0; v->caps && i < v->caps->count; i++) { lstack_push(&s, v->caps->vals[i]); }
+  }
+
+  lstack_free(&s);
+  lstack_free(&seen);
+  return n;
+}
+
+/* End of the call of f, or of a let when f is NULL */
+void lenv_close(lenv* e, lval* f) {
+  if (--e->refs == 0) { lenv_del(e); return; }
+
+  /* Lambdas made here outlive it: keep what lookups in it go on to */
+  if (f) {
+    e->fn = lval_copy(f);
+  } else if (e->par != lenv_top(e)) {
+    e->up = e->par;
+    lenv_hold(e->up);
+  }
+
+  e->internal = lenv_internal(e);
+  e->closed = true;
+  if (e->refs == e->internal) { lenv_del(e); }
 }
 
 /* Builtins */
 
+#define LASSERT_CODE(args, cond, code, fmt, ...) \
+  if (!(cond)) { lval* err = lval_err_code(code, fmt, ##__VA_ARGS__); lval_del(args); return err; }
+
 #define LASSERT(args, cond, fmt, ...) \
-  if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); lval_del(args); return err; }
+  LASSERT_CODE(args, cond, LERR_ERROR, fmt, ##__VA_ARGS__)
 
 #define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect, \
+  LASSERT_CODE(args, args->cell[index]->type == expect, LERR_TYPE, \
     "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.", \
     func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
 
 #define LASSERT_NUM(func, args, num) \
-  LASSERT(args, args->count == num, \
+  LASSERT_CODE(args, args->count == num, LERR_ARITY, \
     "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
     func, args->count, num)
 
@@ -456,6 +1658,108 @@ void lenv_def(lenv* e, lval* k, lval* v) {
     "Function '%s' passed {} for argument %i.", func, index);
 
 lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_ref(lenv* e, lval* v);
+lval* lval_eval_cells(lenv* e, lval** cell, int count);
+lval* lval_eval_borrow(lenv* e, lval* v, lval** tmp);
+void lval_optimize(lenv* e, lval* f);
+lval* lval_call(lenv* e, lval* f, lval* a);
+bool lval_has_sym(lval* v, char* sym);
+
+/* Macros */
+
+/*
+ * A macro is a lambda called on the unevaluated forms of its arguments, each
+ * given as a Q-Expression to splice in with 'join', those after '&' as one
+ * Q-Expression of forms. The code it returns replaces the call. Bodies made
+ * by '\\' and 'fun' are expanded once when made; elsewhere, as at the top
+ * level or in 'eval', a call is expanded when it is evaluated.
+ */
+
+#define LMACRO_MAX_DEPTH 256
+
+/* The macro called by expression x, unless its name is one of the formals */
+lval* lmacro_find(lenv* e, lval* formals, lval* x) {
+  if (lcur->macros == 0) { return NULL; }
+  if (x->count == 0 || x->cell[0]->type != LVAL_SYM) { return NULL; }
+  if (formals && lval_has_sym(formals, x->cell[0]->sym)) { return NULL; }
+  lval* m = lenv_lookup(lenv_top(e), x->cell[0]->sym);
+  return m && m->type == LVAL_FUN && !m->builtin && m->macro ? m : NULL;
+}
+
+/* Code macro m expands to for the forms in cell */
+lval* lmacro_call(lenv* e, lval* m, char* name, lval** cell, int count) {
+  int total = m->formals->count;
+  int required = total;
+  for (int i = 0; i < total; i++) {
+    if (strcmp(m->formals->cell[i]->sym, "&") == 0) { required = i; break; }
+  }
+  if (count < required || (required == total && count > total)) {
+    return lval_err_code(LERR_ARITY,
+      "Macro '%s' passed incorrect number of arguments. Got %i, Expected %i.",
+      name, count, required);
+  }
+
+  lval* a = lval_sexpr();
+  for (int i = 0; i < count; i++) {
+    lval* form = lval_copy(cell[i]);
+    lval_add(a, i < required ? lval_add(lval_qexpr(), form) : form);
+  }
+
+  lval* f = lval_copy(m);
+  lval* x = lval_call(e, f, a);
+  lval_del(f);
+  return x;
+}
+
+/* Expand every macro call in x, taking ownership of it */
+lval* lmacro_expand(lenv* e, lval* formals, lval* x, int depth) {
+  if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { return x; }
+
+  lval* m;
+  while ((m = lmacro_find(e, formals, x))) {
+    if (depth++ == LMACRO_MAX_DEPTH) {
+      lval* err = lval_err("Macro '%s' expanded more than %i times.",
+        x->cell[0]->sym, LMACRO_MAX_DEPTH);
+      lval_del(x);
+      return err;
+    }
+
+    int type = x->type;
+    lval* y = lmacro_call(e, m, x->cell[0]->sym, x->cell + 1, x->count - 1);
+    lval_del(x);
+    if (y->type == LVAL_ERR) { return y; }
+
+    /* A single value stands in for the call, or is the block's only item */
+    if (y->type != LVAL_SEXPR && y->type != LVAL_QEXPR) {
+      return type == LVAL_SEXPR ? y : lval_add(lval_qexpr(), y);
+    }
+    y->type = type;
+    x = y;
+  }
+
+  for (int i = 0; i < x->count; i++) {
+    x->cell[i] = lmacro_expand(e, formals, x->cell[i], depth);
+    if (x->cell[i]->type == LVAL_ERR) {
+      lval* err = lval_pop(x, i);
+      lval_del(x);
+      return err;
+    }
+  }
+  return x;
+}
+
+/* Expand and evaluate a call to macro m met at run time */
+lval* lmacro_eval(lenv* e, lval* m, lval** cell, int count) {
+  lval* x = lmacro_call(e, m, cell[0]->sym, cell + 1, count - 1);
+  if (x->type == LVAL_QEXPR) { x->type = LVAL_SEXPR; }
+  return lval_eval(e, x);
+}
+
+lval* builtin_macroexpand(lenv* e, lval* a) {
+  LASSERT_NUM("macroexpand", a, 1);
+  LASSERT_TYPE("macroexpand", a, 0, LVAL_QEXPR);
+  return lmacro_expand(e, NULL, lval_take(a, 0), 0);
+}
 
 lval* builtin_lambda(lenv* e, lval* a) {
   LASSERT_NUM("\\", a, 2);
@@ -469,10 +1773,14 @@ lval* builtin_lambda(lenv* e, lval* a) {
   }
 
   lval* formals = lval_pop(a, 0);
-  lval* body = lval_pop(a, 0);
+  lval* body = lmacro_expand(e, formals, lval_pop(a, 0), 0);
   lval_del(a);
+  if (body->type == LVAL_ERR) { lval_del(formals); return body; }
 
-  return lval_lambda(formals, body);
+  lval* f = lval_lambda(formals, body);
+  lenv_capture(e, f);
+  lval_optimize(e, f);
+  return f;
 }
 
 lval* builtin_locals(lenv* e, lval* a) {
@@ -488,10 +1796,63 @@ lval* builtin_locals(lenv* e, lval* a) {
   return locals;
 }
 
+/* A list of {name value} pairs, allocations and frees are per type */
+lval* lstats_list(void) {
+  lval* allocs = lval_qexpr();
+  lval* frees = lval_qexpr();
+  for (int t = 0; t < LVAL_TYPES; t++) {
+    lval_add(allocs, lval_add(lval_add(lval_qexpr(), lval_str(ltype_name(t))),
+                              lval_num(lstats.allocs[t])));
+    lval_add(frees, lval_add(lval_add(lval_qexpr(), lval_str(ltype_name(t))),
+                             lval_num(lstats.frees[t])));
+  }
+
+  struct { char* name; lval* v; } items[] = {
+    { "allocs", allocs },
+    { "frees", frees },
+    { "copies", lval_num(lstats.copies) },
+    { "copy-bytes", lval_num(lstats.copy_bytes) },
+    { "lookups", lval_num(lstats.lookups) },
+    { "lookup-depth", lval_dec(lstats.lookups
+        ? (double) lstats.lookup_depth / lstats.lookups : 0) },
+    { "calls", lval_num(lstats.calls) },
+    { "max-depth", lval_num(lstats.max_depth) },
+  };
+
+  lval* x = lval_qexpr();
+  for (size_t i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+    lval_add(x, lval_add(lval_add(lval_qexpr(), lval_str(items[i].name)), items[i].v));
+  }
+  return x;
+}
+
+/* A lone builtin evaluates to itself like any value, so builtins that take
+ * no arguments are called with () instead, as in (runtime-stats ()) */
+void lval_no_args(lval* a) {
+  if (a->count == 1 && a->cell[0]->type == LVAL_SEXPR && a->cell[0]->count == 0) {
+    lval_del(lval_pop(a, 0));
+  }
+}
+
+lval* builtin_runtime_stats(lenv* e, lval* a) {
+  lval_no_args(a);
+  LASSERT_NUM("runtime-stats", a, 0);
+  lval_del(a);
+  return lstats_list();
+}
+
+/* Unwinds like an error, the host decides what exiting means */
 lval* builtin_exit(lenv* e, lval* a) {
+  lval_no_args(a);
+  LASSERT_CODE(a, a->count <= 1, LERR_ARITY,
+    "Function 'exit' passed incorrect number of arguments. Got %i, Expected 0 or 1.",
+    a->count);
+  if (a->count == 1) { LASSERT_TYPE("exit", a, 0, LVAL_NUM); }
+
+  lcur->exited = true;
+  lcur->exit_status = a->count ? (int) a->cell[0]->num : 0;
   lval_del(a);
-  lenv_del(e);
-  exit(0);
+  return lval_err_code(LERR_EXIT, "Exit");
 }
 
 lval* builtin_list(lenv* e, lval* a) {
@@ -554,6 +1915,7 @@ lval* builtin_cons(lenv* e, lval* a) {
 
   list->count++;
   list->cell = realloc(list->cell, sizeof(lval *) * list->count);
+  lquota_heap(sizeof(lval*));
 
   memmove(&list->cell[1], &list->cell[0], sizeof(lval *) * (list->count - 1));
 
@@ -603,13 +1965,15 @@ long max(long x, long y) {
 }
 
 lval* builtin_op(lenv* e, lval* a, char* op) {
+  LASSERT_CODE(a, a->count > 0, LERR_ARITY,
+    "Function '%s' passed no arguments.", op);
 
   /* Ensure all arguments are numbers */
   for (size_t i = 0; i < a->count; i++) {
       // TODO: LASSERT_TYPE(op, a, i, LVAL_NUM) || LASSERT_TYPE(op, a, i, LVAL_DEC);
       if (a->cell[i]->type != LVAL_NUM && a->cell[i]->type != LVAL_DEC) {
           lval_del(a);
-          return lval_err("Cannot operate on non-number/non-decimal!");
+          return lval_err_code(LERR_TYPE, "Cannot operate on non-number/non-decimal!");
       }
   }
 
@@ -627,7 +1991,7 @@ lval* builtin_op(lenv* e, lval* a, char* op) {
       if (strcmp(op, "/") == 0) {
         if (y->num == 0) {
           lval_del(x); lval_del(y);
-          x = lval_err("Division By Zero.");
+          x = lval_err_code(LERR_DIV_ZERO, "Division By Zero.");
           break;
         }
         x->num /= y->num;
@@ -649,7 +2013,7 @@ lval* builtin_op(lenv* e, lval* a, char* op) {
           if (c == 0) {
               lval_del(x);
               lval_del(y);
-              x = lval_err("Division by zero!");
+              x = lval_err_code(LERR_DIV_ZERO, "Division by zero!");
               break;
           }
           b /= c;
@@ -707,22 +2071,32 @@ lval* builtin_var(lenv* e, lval* a, char* func) {
 lval* builtin_def(lenv* e, lval* a) { return builtin_var(e, a, "def"); }
 lval* builtin_put(lenv* e, lval* a) { return builtin_var(e, a, "="); }
 
-lval* builtin_fun(lenv* e, lval* a) {
-  LASSERT_NUM("fun", a, 2);
-  LASSERT_TYPE("fun", a, 0, LVAL_QEXPR);
-  LASSERT_TYPE("fun", a, 1, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("fun", a, 0);
+lval* builtin_fun_def(lenv* e, lval* a, char* func, bool macro) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+  LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY(func, a, 0);
 
   lval* name = lval_pop(a->cell[0], 0);
-  lval* args = lval_copy(a->cell[0]);
-  lval* body = lval_copy(a->cell[1]);
+  lval* args = lval_pop(a, 0);
+  lval* body = lmacro_expand(e, args, lval_pop(a, 0), 0);
+  lval_del(a);
+  if (body->type == LVAL_ERR) { lval_del(name); lval_del(args); return body; }
 
-  lenv_def(e, name, lval_lambda(args, body));
+  lval* f = lval_lambda(args, body);
+  lenv_capture(e, f);
+  f->macro = macro;
+  lval_optimize(e, f);
+  lenv_def(e, name, f);
+  if (macro) { lcur->macros++; }
 
-  lval_del(a);
+  lval_del(f); lval_del(name);
   return lval_sexpr();
 }
 
+lval* builtin_fun(lenv* e, lval* a) { return builtin_fun_def(e, a, "fun", false); }
+lval* builtin_defmacro(lenv* e, lval* a) { return builtin_fun_def(e, a, "defmacro", true); }
+
 lval* builtin_ord(lenv* e, lval* a, char* op) {
   LASSERT_NUM(op, a, 2);
   LASSERT_TYPE(op, a, 0, LVAL_NUM);
@@ -744,64 +2118,232 @@ lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, "<="); }
 
 lval* builtin_cmp(lenv* e, lval* a, char* op) {
   LASSERT_NUM(op, a, 2);
-  lval* r;
-  if (strcmp(op, "==") == 0) { r =  lval_eq(a->cell[0], a->cell[1]); }
-  if (strcmp(op, "!=") == 0) { r = lval_eq(a->cell[0], a->cell[1]); r = lval_bln(strcmp(r->bln, "true")); }
+  bool r = lval_eq(a->cell[0], a->cell[1]);
+  if (strcmp(op, "!=") == 0) { r = !r; }
   lval_del(a);
-  return r;
+  return lval_bln(r);
 }
 
 lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, "=="); }
 lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, "!="); }
 
-lval* builtin_if(lenv* e, lval* a) {
-  LASSERT_NUM("if", a, 3);
-  LASSERT_TYPE("if", a, 0, LVAL_NUM);
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+bool lval_truthy(lval* v) {
+  if (v->type == LVAL_BOOL) { return strcmp(v->bln, "true") == 0; }
+  return v->num != 0;
+}
+
+/* Special Forms */
 
-  lval* x;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
+typedef lval*(*lform)(lenv*, lval**, int);
 
-  if (a->cell[0]->num) {
-    x = lval_eval(e, lval_pop(a, 1));
-  } else {
-    x = lval_eval(e, lval_pop(a, 2));
+#define LFORM_NUM(func, count, num) \
+  if (count != num) { \
+    return lval_err_code(LERR_ARITY, \
+      "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.", \
+      func, count, num); \
   }
 
-  lval_del(a);
+lval* lform_cond_err(char* func, int index, lval* c) {
+  return lval_err_code(LERR_TYPE,
+    "Function '%s' passed incorrect type for argument %i. "
+    "Got %s, Expected %s or %s.", func, index, ltype_name(c->type),
+    ltype_name(LVAL_NUM), ltype_name(LVAL_BOOL));
+}
+
+/* A Q-Expression argument, borrowed when written literally. Otherwise it is
+ * evaluated into *tmp, which the caller deletes, as are any errors */
+lval* lform_qexpr(lenv* e, char* func, lval* x, int index, lval** tmp) {
+  *tmp = NULL;
+  if (x->type == LVAL_QEXPR) { return x; }
+
+  lval* q = lval_eval_ref(e, x);
+  if (q->type != LVAL_QEXPR && q->type != LVAL_ERR) {
+    lval* err = lval_err_code(LERR_TYPE,
+      "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",
+      func, index, ltype_name(q->type), ltype_name(LVAL_QEXPR));
+    lval_del(q);
+    q = err;
+  }
+  *tmp = q;
+  return q;
+}
+
+/* Clauses of 'select' and 'case' are pairs of expressions */
+lval* lform_clause(lenv* e, char* func, lval* x, int index, lval** tmp) {
+  lval* q = lform_qexpr(e, func, x, index, tmp);
+  if (q->type == LVAL_QEXPR && q->count != 2) {
+    lval* err = lval_err("Function '%s' passed clause of %i items for argument %i, Expected 2.",
+      func, q->count, index);
+    if (*tmp) { lval_del(*tmp); }
+    q = *tmp = err;
+  }
+  return q;
+}
+
+lval* lform_if(lenv* e, lval** args, int count) {
+  LFORM_NUM("if", count, 3);
+
+  lval* tmp;
+  lval* c = lval_eval_borrow(e, args[0], &tmp);
+  if (c->type == LVAL_ERR) { return c; }
+  if (c->type != LVAL_NUM && c->type != LVAL_BOOL) {
+    lval* err = lform_cond_err("if", 0, c);
+    if (tmp) { lval_del(tmp); }
+    return err;
+  }
+
+  int taken = lval_truthy(c) ? 1 : 2;
+  if (tmp) { lval_del(tmp); }
+
+  lval* q = lform_qexpr(e, "if", args[taken], taken, &tmp);
+  if (q->type == LVAL_ERR) { return q; }
+  lval* x = lval_eval_cells(e, q->cell, q->count);
+  if (tmp) { lval_del(tmp); }
   return x;
 }
 
-lval* builtin_or(lenv* e, lval* a) {
-  LASSERT_NUM("||", a, 2);
-  LASSERT_TYPE("||", a, 0, LVAL_NUM);
-  LASSERT_TYPE("||", a, 1, LVAL_NUM);
+/* The second operand is only evaluated if the first doesn't decide the
+ * result, which is a Boolean if either operand evaluated was one */
+lval* lform_logic(lenv* e, lval** args, int count, char* op, bool decides) {
+  LFORM_NUM(op, count, 2);
+
+  bool bln = false;
+  bool r = false;
+  for (int i = 0; i < 2; i++) {
+    lval* tmp;
+    lval* x = lval_eval_borrow(e, args[i], &tmp);
+    if (x->type == LVAL_ERR) { return x; }
+    if (x->type != LVAL_NUM && x->type != LVAL_BOOL) {
+      lval* err = lform_cond_err(op, i, x);
+      if (tmp) { lval_del(tmp); }
+      return err;
+    }
+    bln = bln || x->type == LVAL_BOOL;
+    r = lval_truthy(x);
+    if (tmp) { lval_del(tmp); }
+    if (r == decides) { break; }
+  }
+  return bln ? lval_bln(r) : lval_num(r);
+}
 
-  lval* x = lval_pop(a, 0);
-  lval* y = lval_pop(a, 0);
+lval* lform_and(lenv* e, lval** args, int count) {
+  return lform_logic(e, args, count, "&&", false);
+}
 
-  x->num = (x->num || y->num);
-  lval_del(y);
-  lval_del(a);
+lval* lform_or(lenv* e, lval** args, int count) {
+  return lform_logic(e, args, count, "||", true);
+}
+
+/* Value of the last expression, or {} if there are none */
+lval* lform_do(lenv* e, lval** args, int count) {
+  if (count == 0) { return lval_qexpr(); }
+
+  for (int i = 0; i < count - 1; i++) {
+    lval* x = lval_eval_ref(e, args[i]);
+    if (x->type == LVAL_ERR) { return x; }
+    lval_del(x);
+  }
+  return lval_eval_ref(e, args[count-1]);
+}
+
+/* Run the body in a new scope */
+lval* lform_let(lenv* e, lval** args, int count) {
+  LFORM_NUM("let", count, 1);
+
+  lval* tmp;
+  lval* q = lform_qexpr(e, "let", args[0], 0, &tmp);
+  if (q->type == LVAL_ERR) { return q; }
+
+  lenv* env = lenv_new();
+  env->par = e;
+  lval* x = lval_eval_cells(env, q->cell, q->count);
+  lenv_close(env, NULL);
+
+  if (tmp) { lval_del(tmp); }
   return x;
 }
 
-lval* builtin_and(lenv* e, lval* a) {
-  LASSERT_NUM("&&", a, 2);
-  LASSERT_TYPE("&&", a, 0, LVAL_NUM);
-  LASSERT_TYPE("&&", a, 1, LVAL_NUM);
+/* First clause {condition value} whose condition holds */
+lval* lform_select(lenv* e, lval** args, int count) {
+  for (int i = 0; i < count; i++) {
+    lval* tmp;
+    lval* q = lform_clause(e, "select", args[i], i, &tmp);
+    if (q->type == LVAL_ERR) { return q; }
+
+    lval* c = lval_eval_cells(e, q->cell, 1);
+    if (c->type != LVAL_ERR && c->type != LVAL_NUM && c->type != LVAL_BOOL) {
+      lval* err = lform_cond_err("select", i, c);
+      lval_del(c);
+      c = err;
+    }
 
-  lval* x = lval_pop(a, 0);
-  lval* y = lval_pop(a, 0);
+    lval* x = NULL;
+    if (c->type == LVAL_ERR) {
+      x = c;
+    } else {
+      if (lval_truthy(c)) { x = lval_eval_cells(e, q->cell + 1, 1); }
+      lval_del(c);
+    }
+    if (tmp) { lval_del(tmp); }
+    if (x) { return x; }
+  }
+  return lval_err_user(NULL, "No Selection Found", lval_str("No Selection Found"));
+}
 
-  x->num = (x->num && y->num);
-  lval_del(y);
+/* First clause {key value} whose key is equal to the first argument */
+lval* lform_case(lenv* e, lval** args, int count) {
+  if (count == 0) {
+    return lval_err_code(LERR_ARITY,
+      "Function 'case' passed incorrect number of arguments. Got 0, Expected at least 1.");
+  }
+
+  lval* x = lval_eval_ref(e, args[0]);
+  if (x->type == LVAL_ERR) { return x; }
+
+  for (int i = 1; i < count; i++) {
+    lval* tmp;
+    lval* q = lform_clause(e, "case", args[i], i, &tmp);
+    if (q->type == LVAL_ERR) { lval_del(x); return q; }
+
+    lval* k = lval_eval_cells(e, q->cell, 1);
+    if (k->type == LVAL_ERR) {
+      lval_del(x);
+      if (tmp) { lval_del(tmp); }
+      return k;
+    }
+
+    bool matched = lval_eq(x, k);
+    lval_del(k);
+
+    if (matched) {
+      lval* y = lval_eval_cells(e, q->cell + 1, 1);
+      lval_del(x);
+      if (tmp) { lval_del(tmp); }
+      return y;
+    }
+    if (tmp) { lval_del(tmp); }
+  }
+
+  lval_del(x);
+  return lval_err_user(NULL, "No Case Found", lval_str("No Case Found"));
+}
+
+/* Called as values the arguments are already evaluated, which is harmless
+ * as evaluating a value gives the same value */
+lval* lform_apply(lenv* e, lform form, lval* a) {
+  lval* x = form(e, a->cell, a->count);
   lval_del(a);
   return x;
 }
 
+lval* builtin_if(lenv* e, lval* a) { return lform_apply(e, lform_if, a); }
+lval* builtin_and(lenv* e, lval* a) { return lform_apply(e, lform_and, a); }
+lval* builtin_or(lenv* e, lval* a) { return lform_apply(e, lform_or, a); }
+lval* builtin_do(lenv* e, lval* a) { return lform_apply(e, lform_do, a); }
+lval* builtin_let(lenv* e, lval* a) { return lform_apply(e, lform_let, a); }
+lval* builtin_select(lenv* e, lval* a) { return lform_apply(e, lform_select, a); }
+lval* builtin_case(lenv* e, lval* a) { return lform_apply(e, lform_case, a); }
+
 lval* builtin_not (lenv* e, lval* a) {
   LASSERT_NUM("!", a, 1);
   LASSERT_TYPE("!", a, 0, LVAL_NUM);
@@ -814,101 +2356,3482 @@ lval* builtin_not (lenv* e, lval* a) {
 }
 
 lval* lval_read(mpc_ast_t* t);
+void lsource_record(char* path);
 
-lval* builtin_load(lenv* e, lval* a) {
-  LASSERT_NUM("load", a, 1);
-  LASSERT_TYPE("load", a, 0, LVAL_STR);
+/* Evaluate each expression of a parsed file, consuming the parse result and
+ * adding the number that gave errors to failed, if given */
+lval* lenv_load_parsed(lenv* e, char* filename, bool parsed, mpc_result_t* r, int* failed) {
 
-  /* Parse File given by string name */
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
+  LTRACE(load, filename);
+
+  if (parsed) {
 
     /* Read contents */
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
+    lval* expr = lval_read(r->output);
+    mpc_ast_delete(r->output);
 
     /* Evaluate each Expression */
     while (expr->count) {
       lval* x = lval_eval(e, lval_pop(expr, 0));
+      if (lcur->exited || lcur->breach) { lval_del(expr); return x; }
       /* If Evaluation leads to error print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
+      if (x->type == LVAL_ERR) { lval_println(x); if (failed) { (*failed)++; } }
       lval_del(x);
     }
 
-    /* Delete expressions and arguments */
+    /* Delete expressions and return empty list */
     lval_del(expr);
-    lval_del(a);
-
-    /* Return empty list */
     return lval_sexpr();
 
   } else {
     /* Get Parse Error as String */
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
+    char* err_msg = mpc_err_string(r->error);
+    mpc_err_delete(r->error);
 
     /* Create new error message using it */
     lval* err = lval_err("Could not load Library %s", err_msg);
     free(err_msg);
-    lval_del(a);
-
-    /* Cleanup and return error */
     return err;
   }
 }
 
+lval* builtin_load(lenv* e, lval* a) {
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+  /* Parse File given by string name */
+  mpc_result_t r;
+  bool parsed = mpc_parse_contents(a->cell[0]->str, lcur->Lispy, &r);
+
+  lval* x = lenv_load_parsed(e, a->cell[0]->str, parsed, &r, NULL);
+
+  /* Remember its forms, so a reload only evaluates those that change */
+  if (parsed && !lcur->exited && !lcur->breach) { lsource_record(a->cell[0]->str); }
+  lval_del(a);
+  return x;
+}
+
 lval* builtin_print(lenv* e, lval* a) {
 
   /* Print each argument followed by a space */
   for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]); putchar(' ');
+    lval_print(&lcur->out->out, a->cell[i]); lbuf_putc(&lcur->out->out, ' ');
   }
 
   /* Print a newline and delete arguments */
-  putchar('\n');
+  lbuf_putc(&lcur->out->out, '\n');
   lval_del(a);
 
   return lval_sexpr();
 }
 
 lval* builtin_error(lenv* e, lval* a) {
-  LASSERT_NUM("error", a, 1);
+  LASSERT_CODE(a, a->count == 1 || a->count == 2, LERR_ARITY,
+    "Function 'error' passed incorrect number of arguments. Got %i, Expected 1 or 2.",
+    a->count);
   LASSERT_TYPE("error", a, 0, LVAL_STR);
 
-  /* Construct Error from first argument */
-  lval* err = lval_err(a->cell[0]->str);
+  /* Construct Error from first argument, carrying the optional second */
+  lval* payload = a->count == 2 ? lval_pop(a, 1) : lval_copy(a->cell[0]);
+  lval* err = lval_err_user(NULL, a->cell[0]->str, payload);
 
   /* Delete arguments and return */
   lval_del(a);
   return err;
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-  lval* k = lval_sym(name);
-  lval* v = lval_builtin(func);
-  lenv_put(e, k, v);
-  lval_del(k); lval_del(v);
+lval* builtin_throw(lenv* e, lval* a) {
+  LASSERT_NUM("throw", a, 2);
+  LASSERT_TYPE("throw", a, 0, LVAL_STR);
+
+  lval* payload = lval_pop(a, 1);
+  lbuf b;
+  lbuf_init(&b, NULL);
+  lbuf_printf(&b, "Uncaught '%s'", a->cell[0]->str);
+  lval* err = lval_err_user(a->cell[0]->str, lbuf_cstr(&b), payload);
+  lbuf_free(&b);
+
+  lval_del(a);
+  return err;
 }
 
-void lenv_add_builtins(lenv* e) {
-  /* Variable Functions */
-  lenv_add_builtin(e, "\\",  builtin_lambda);
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "=",   builtin_put);
-  lenv_add_builtin(e, "fun", builtin_fun);
-  lenv_add_builtin(e, "locals", builtin_locals);
+lval* lval_call(lenv* e, lval* f, lval* a);
 
-  /* List Functions */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
+/* Handlers are called with the error code and its payload */
+lval* builtin_try(lenv* e, lval* a) {
+  LASSERT_NUM("try", a, 2);
+  LASSERT_TYPE("try", a, 0, LVAL_QEXPR);
+  LASSERT_TYPE("try", a, 1, LVAL_FUN);
 
-  /* Q-Expression Functions */
-  lenv_add_builtin(e, "cons", builtin_cons);
-  lenv_add_builtin(e, "len", builtin_len);
-  lenv_add_builtin(e, "init", builtin_init);
+  lval* x = builtin_eval(e, lval_add(lval_sexpr(), lval_pop(a, 0)));
+  if (x->type != LVAL_ERR || x->err->code == LERR_EXIT || x->err->code == LERR_QUOTA) {
+    lval_del(a);
+    return x;
+  }
+
+  lerr* r = x->err;
+  lval* payload = r->payload;
+  if (payload) {
+    r->payload = NULL;
+  } else {
+    payload = lval_str(lerr_message(r));
+  }
+
+  lval* args = lval_add(lval_sexpr(), lval_str(lerr_code_name(r)));
+  lval_add(args, payload);
+  lval_del(x);
+
+  lval* f = lval_pop(a, 0);
+  lval_del(a);
+  lval* y = lval_call(e, f, args);
+  lval_del(f);
+  return y;
+}
+
+/* Sorting */
+
+/*
+ * A stable merge sort. Lists of only Numbers or only Strings are compared
+ * directly on keys pulled out beforehand, and large ones are split across
+ * threads, one per core. Anything else needs a comparator, which is called
+ * through the interpreter and so stays on the calling thread.
+ */
+
+#define LSORT_SMALL 16
+#define LSORT_PARALLEL (1 << 16)
+
+enum { LSORT_NUM, LSORT_DEC, LSORT_STR, LSORT_FUN };
+
+typedef struct {
+  lval* v;
+  union { long i; double d; char* s; } key;
+} lsort_item;
+
+typedef struct {
+  int kind;
+  lenv* e;
+  lval* f;
+  lval* err;
+} lsort;
+
+bool lsort_less(lsort* s, lsort_item* a, lsort_item* b) {
+  switch (s->kind) {
+    case LSORT_NUM: return a->key.i < b->key.i;
+    case LSORT_DEC: return a->key.d < b->key.d;
+    case LSORT_STR: return strcmp(a->key.s, b->key.s) < 0;
+  }
+
+  /* After an error the remaining comparisons are skipped */
+  if (s->err) { return false; }
+  lval* args = lval_add(lval_sexpr(), lval_copy(a->v));
+  lval_add(args, lval_copy(b->v));
+  lval* r = lval_call(s->e, s->f, args);
+  if (r->type != LVAL_NUM && r->type != LVAL_BOOL) {
+    if (r->type != LVAL_ERR) {
+      lval* err = lval_err_code(LERR_TYPE,
+        "Function 'sort-by' comparator returned %s, Expected %s or %s.",
+        ltype_name(r->type), ltype_name(LVAL_NUM), ltype_name(LVAL_BOOL));
+      lval_del(r);
+      r = err;
+    }
+    s->err = r;
+    return false;
+  }
+  bool less = lval_truthy(r);
+  lval_del(r);
+  return less;
+}
+
+/* Items from the right half only go first when strictly less, keeping it stable */
+void lsort_merge(lsort* s, lsort_item* a, size_t n, size_t mid, lsort_item* tmp) {
+  memcpy(tmp, a, sizeof(lsort_item) * mid);
+  size_t i = 0, j = mid, k = 0;
+  while (i < mid && j < n) {
+    a[k++] = lsort_less(s, &a[j], &tmp[i]) ? a[j++] : tmp[i++];
+  }
+  memcpy(a + k, tmp + i, sizeof(lsort_item) * (mid - i));
+}
+
+void lsort_run(lsort* s, lsort_item* a, size_t n, lsort_item* tmp) {
+  if (n <= LSORT_SMALL) {
+    for (size_t i = 1; i < n; i++) {
+      lsort_item x = a[i];
+      size_t j = i;
+      while (j > 0 && lsort_less(s, &x, &a[j-1])) { a[j] = a[j-1]; j--; }
+      a[j] = x;
+    }
+    return;
+  }
+
+  size_t mid = n / 2;
+  lsort_run(s, a, mid, tmp);
+  lsort_run(s, a + mid, n - mid, tmp + mid);
+  if (lsort_less(s, &a[mid], &a[mid-1])) { lsort_merge(s, a, n, mid, tmp); }
+}
+
+#ifndef _WIN32
+
+typedef struct {
+  lsort* s;
+  lsort_item* a;
+  size_t n;
+  lsort_item* tmp;
+  int depth;
+} lsort_job;
+
+void lsort_parallel(lsort_job* j);
+
+void* lsort_thread(void* arg) {
+  lsort_parallel(arg);
+  return NULL;
+}
+
+/* Sort the left half on a new thread while this one does the right */
+void lsort_parallel(lsort_job* j) {
+  if (j->depth == 0 || j->n < LSORT_PARALLEL) {
+    lsort_run(j->s, j->a, j->n, j->tmp);
+    return;
+  }
+
+  size_t mid = j->n / 2;
+  lsort_job left = { j->s, j->a, mid, j->tmp, j->depth - 1 };
+  lsort_job right = { j->s, j->a + mid, j->n - mid, j->tmp + mid, j->depth - 1 };
+
+  pthread_t t;
+  bool spawned = pthread_create(&t, NULL, lsort_thread, &left) == 0;
+  if (!spawned) { lsort_parallel(&left); }
+  lsort_parallel(&right);
+  if (spawned) { pthread_join(t, NULL); }
+
+  if (lsort_less(j->s, &j->a[mid], &j->a[mid-1])) {
+    lsort_merge(j->s, j->a, j->n, mid, j->tmp);
+  }
+}
+
+#endif
+
+/* Sorts the list in place, returning it or an error from the comparator */
+lval* lsort_list(lsort* s, lval* l) {
+  size_t n = l->count;
+  lsort_item* items = malloc(sizeof(lsort_item) * (n + 1));
+  lsort_item* tmp = malloc(sizeof(lsort_item) * (n + 1));
+
+  for (size_t i = 0; i < n; i++) {
+    lval* v = l->cell[i];
+    items[i].v = v;
+    if (s->kind == LSORT_NUM) { items[i].key.i = v->num; }
+    if (s->kind == LSORT_DEC) { items[i].key.d = v->type == LVAL_DEC ? v->dec : v->num; }
+    if (s->kind == LSORT_STR) { items[i].key.s = v->str; }
+  }
+
+#ifndef _WIN32
+  if (s->kind != LSORT_FUN && n >= LSORT_PARALLEL) {
+    int depth = 0;
+    for (long cores = sysconf(_SC_NPROCESSORS_ONLN); cores > 1; cores /= 2) { depth++; }
+    lsort_job j = { s, items, n, tmp, depth };
+    lsort_parallel(&j);
+  } else {
+    lsort_run(s, items, n, tmp);
+  }
+#else
+  lsort_run(s, items, n, tmp);
+#endif
+
+  for (size_t i = 0; i < n; i++) { l->cell[i] = items[i].v; }
+  free(items);
+  free(tmp);
+
+  if (s->err) {
+    lval_del(l);
+    return s->err;
+  }
+  return l;
+}
+
+lval* builtin_sort(lenv* e, lval* a) {
+  LASSERT_NUM("sort", a, 1);
+  LASSERT_TYPE("sort", a, 0, LVAL_QEXPR);
+
+  lval* l = a->cell[0];
+  lsort s = { LSORT_NUM, e, NULL, NULL };
+  if (l->count > 0 && l->cell[0]->type == LVAL_STR) { s.kind = LSORT_STR; }
+
+  for (int i = 0; i < l->count; i++) {
+    int t = l->cell[i]->type;
+    if (t == LVAL_DEC && s.kind == LSORT_NUM) { s.kind = LSORT_DEC; }
+    LASSERT_CODE(a, s.kind == LSORT_STR ? t == LVAL_STR : (t == LVAL_NUM || t == LVAL_DEC),
+      LERR_TYPE, "Function 'sort' passed a list holding %s at %i, "
+      "Expected only Numbers or only Strings. Use 'sort-by' with a comparator.",
+      ltype_name(t), i);
+  }
+
+  return lsort_list(&s, lval_take(a, 0));
+}
+
+/* The comparator is called as (f x y), and is true when x goes before y */
+lval* builtin_sort_by(lenv* e, lval* a) {
+  LASSERT_NUM("sort-by", a, 2);
+  LASSERT_TYPE("sort-by", a, 0, LVAL_FUN);
+  LASSERT_TYPE("sort-by", a, 1, LVAL_QEXPR);
+
+  lval* f = lval_pop(a, 0);
+  lsort s = { LSORT_FUN, e, f, NULL };
+  lval* x = lsort_list(&s, lval_take(a, 0));
+  lval_del(f);
+  return x;
+}
+
+/* Port Functions */
+
+#define LASSERT_OPEN(func, args, index) \
+  LASSERT(args, args->cell[index]->port->file, \
+    "Function '%s' passed closed port for argument %i.", func, index)
+
+lval* builtin_open(lenv* e, lval* a) {
+  LASSERT_NUM("open", a, 2);
+  LASSERT_TYPE("open", a, 0, LVAL_STR);
+  LASSERT_TYPE("open", a, 1, LVAL_STR);
+
+  char* mode = a->cell[1]->str;
+  LASSERT(a, strcmp(mode, "r") == 0 || strcmp(mode, "w") == 0 || strcmp(mode, "a") == 0,
+    "Function 'open' passed invalid mode '%s'. Expected \"r\", \"w\" or \"a\".", mode);
+
+  FILE* f = fopen(a->cell[0]->str, mode);
+  LASSERT(a, f, "Could not open '%s': %s", a->cell[0]->str, strerror(errno));
+
+  /* Ports do their own buffering */
+  setvbuf(f, NULL, _IONBF, 0);
+
+  lval* x = lval_port(lport_new(f));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_close(lenv* e, lval* a) {
+  LASSERT_NUM("close", a, 1);
+  LASSERT_TYPE("close", a, 0, LVAL_PORT);
+
+  lport_close(a->cell[0]->port);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_flush(lenv* e, lval* a) {
+  LASSERT_NUM("flush", a, 1);
+  LASSERT_TYPE("flush", a, 0, LVAL_PORT);
+
+  lbuf_flush(&a->cell[0]->port->out);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Next line without its newline, or NULL at end of input */
+lval* lport_read_line(lport* p) {
+  size_t scanned = 0;
+  while (1) {
+    char* start = p->in + p->in_pos;
+    size_t avail = p->in_len - p->in_pos;
+    char* nl = avail > scanned ? memchr(start + scanned, '\n', avail - scanned) : NULL;
+    if (nl) {
+      p->in_pos += (nl - start) + 1;
+      return lval_strn(start, nl - start);
+    }
+    scanned = avail;
+    if (lport_fill(p) == 0) {
+      /* Filling may have moved the unconsumed input */
+      if (avail == 0) { return NULL; }
+      start = p->in + p->in_pos;
+      p->in_pos += avail;
+      return lval_strn(start, avail);
+    }
+  }
+}
+
+lval* builtin_read_line(lenv* e, lval* a) {
+  LASSERT_NUM("read-line", a, 1);
+  LASSERT_TYPE("read-line", a, 0, LVAL_PORT);
+  LASSERT_OPEN("read-line", a, 0);
+
+  lval* x = lport_read_line(a->cell[0]->port);
+  lval_del(a);
+
+  /* Empty list signals end of input */
+  return x ? x : lval_qexpr();
+}
+
+lval* builtin_read(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'read' passed incorrect number of arguments. "
+    "Got %i, Expected 1 or 2.", a->count);
+  LASSERT_TYPE("read", a, 0, LVAL_PORT);
+  LASSERT_OPEN("read", a, 0);
+  if (a->count == 2) {
+    LASSERT_TYPE("read", a, 1, LVAL_NUM);
+    LASSERT(a, a->cell[1]->num > 0,
+      "Function 'read' passed non-positive size %li.", a->cell[1]->num);
+  }
+
+  /* Without a size read the rest of the input */
+  lport* p = a->cell[0]->port;
+  size_t want = a->count == 2 ? (size_t) a->cell[1]->num : (size_t) -1;
+  while (p->in_len - p->in_pos < want && lport_fill(p) > 0) {}
+
+  size_t avail = p->in_len - p->in_pos;
+  size_t n = avail < want ? avail : want;
+  lval_del(a);
+  if (n == 0) { return lval_qexpr(); }
+
+  lval* x = lval_strn(p->in + p->in_pos, n);
+  p->in_pos += n;
+  return x;
+}
+
+lval* builtin_write(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1,
+    "Function 'write' passed incorrect number of arguments. "
+    "Got %i, Expected at least 1.", a->count);
+  LASSERT_TYPE("write", a, 0, LVAL_PORT);
+  LASSERT_OPEN("write", a, 0);
+
+  /* Strings are written raw, everything else as printed */
+  lbuf* b = &a->cell[0]->port->out;
+  for (int i = 1; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_STR) {
+      lbuf_puts(b, a->cell[i]->str);
+    } else {
+      lval_print(b, a->cell[i]);
+    }
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_each_line(lenv* e, lval* a) {
+  LASSERT_NUM("each-line", a, 2);
+  LASSERT_TYPE("each-line", a, 0, LVAL_PORT);
+  LASSERT_TYPE("each-line", a, 1, LVAL_FUN);
+  LASSERT_OPEN("each-line", a, 0);
+
+  lport* p = a->cell[0]->port;
+  lval* line;
+  while ((line = lport_read_line(p))) {
+    lval* x = lval_call(e, a->cell[1], lval_add(lval_sexpr(), line));
+    if (x->type == LVAL_ERR) { lval_del(a); return x; }
+    lval_del(x);
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Delimited Files */
+
+/*
+ * CSV and TSV are scanned in place, a field at a time, remembering where
+ * each wanted field starts and ends. A column is made of Numbers or
+ * Decimals when all of its fields look like them, so values are only
+ * built once the whole file has been seen. Fields may be quoted, with ""
+ * standing for a quote, and then span delimiters and lines.
+ */
+
+typedef struct {
+  char* start;
+  uint32_t len;
+  bool quoted;
+} lcsv_field;
+
+enum { LCSV_EMPTY, LCSV_INT, LCSV_DEC, LCSV_STR };
+
+/* Scan the field at p, returning where the next one starts, NULL inside an open quote */
+char* lcsv_scan(char* p, char* end, char delim, lcsv_field* f, bool* last) {
+  if (p < end && *p == '"') {
+    f->start = ++p;
+    f->quoted = true;
+    while (1) {
+      char* q = memchr(p, '"', end - p);
+      if (!q) { return NULL; }
+      if (q + 1 < end && q[1] == '"') { p = q + 2; continue; }
+      f->len = q - f->start;
+      p = q + 1;
+      break;
+    }
+    /* Anything between the closing quote and the delimiter is dropped */
+    while (p < end && *p != delim && *p != '\n') { p++; }
+  } else {
+    f->start = p;
+    f->quoted = false;
+    while (p < end && *p != delim && *p != '\n') { p++; }
+    f->len = p - f->start;
+    if (f->len && f->start[f->len - 1] == '\r' && (p == end || *p == '\n')) { f->len--; }
+  }
+
+  *last = p == end || *p == '\n';
+  return p == end ? p : p + 1;
+}
+
+int lcsv_kind(lcsv_field* f) {
+  if (f->len == 0) { return LCSV_EMPTY; }
+  char* s = f->start;
+  char* end = s + f->len;
+  if (*s == '-' || *s == '+') { s++; }
+
+  char* digits = s;
+  while (s < end && *s >= '0' && *s <= '9') { s++; }
+  if (s == end && s > digits && s - digits <= 18) { return LCSV_INT; }
+
+  /* Anything else strtod takes in full */
+  char buf[64];
+  if (f->len >= sizeof(buf)) { return LCSV_STR; }
+  memcpy(buf, f->start, f->len);
+  buf[f->len] = '\0';
+  char* stop;
+  strtod(buf, &stop);
+  return stop == buf + f->len && stop > buf ? LCSV_DEC : LCSV_STR;
+}
+
+lval* lcsv_value(lcsv_field* f, int kind) {
+  if (kind == LCSV_INT) {
+    if (f->len == 0) { return lval_qexpr(); }
+    char* s = f->start;
+    char* end = s + f->len;
+    bool neg = *s == '-';
+    if (*s == '-' || *s == '+') { s++; }
+    long n = 0;
+    for (; s < end; s++) { n = n * 10 + (*s - '0'); }
+    return lval_num(neg ? -n : n);
+  }
+
+  if (kind == LCSV_DEC) {
+    if (f->len == 0) { return lval_qexpr(); }
+    char buf[64];
+    memcpy(buf, f->start, f->len);
+    buf[f->len] = '\0';
+    return lval_dec(strtod(buf, NULL));
+  }
+
+  lval* x = lval_strn(f->start, f->len);
+  if (f->quoted) {
+    /* Collapse doubled quotes */
+    char* w = x->str;
+    for (char* r = x->str; *r; r++) {
+      *w++ = *r;
+      if (*r == '"' && r[1] == '"') { r++; }
+    }
+    *w = '\0';
+    lquota_heap(w - x->str - (long) f->len);
+  }
+  return x;
+}
+
+#define LASSERT_DELIM(func, args, index) \
+  LASSERT_TYPE(func, args, index, LVAL_STR); \
+  LASSERT(args, strlen(args->cell[index]->str) == 1 && args->cell[index]->str[0] != '"' \
+    && args->cell[index]->str[0] != '\n', \
+    "Function '%s' passed invalid delimiter \"%s\".", func, args->cell[index]->str)
+
+/* The whole file, mapped where possible */
+char* lcsv_load(char* path, size_t* size) {
+#ifndef _WIN32
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { return NULL; }
+  struct stat st;
+  fstat(fd, &st);
+  *size = st.st_size;
+  char* data = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+  close(fd);
+  if (data == MAP_FAILED) { return NULL; }
+  if (*size) { madvise(data, *size, MADV_SEQUENTIAL); }
+  return data;
+#else
+  FILE* f = fopen(path, "rb");
+  if (!f) { return NULL; }
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char* data = malloc(*size + 1);
+  *size = fread(data, 1, *size, f);
+  fclose(f);
+  return data;
+#endif
+}
+
+void lcsv_unload(char* data, size_t size) {
+#ifndef _WIN32
+  if (size) { munmap(data, size); }
+#else
+  free(data);
+#endif
+}
+
+/* Output slot of each input column, -1 when it isn't wanted, NULL if cols names a missing one */
+int* lcsv_project(lval* header, lval* cols, int* nout, lval** missing) {
+  int* slot = malloc(sizeof(int) * (header->count + 1));
+  for (int i = 0; i < header->count; i++) { slot[i] = cols ? -1 : i; }
+  *nout = cols ? cols->count : header->count;
+  if (!cols) { return slot; }
+
+  for (int j = 0; j < cols->count; j++) {
+    lval* c = cols->cell[j];
+    int i = 0;
+    if (c->type == LVAL_NUM) {
+      i = c->num >= 0 && c->num < header->count ? c->num : header->count;
+    } else {
+      while (i < header->count && strcmp(header->cell[i]->str, c->str) != 0) { i++; }
+    }
+    if (i == header->count) {
+      *missing = c;
+      free(slot);
+      return NULL;
+    }
+    slot[i] = j;
+  }
+  return slot;
+}
+
+lval* builtin_read_csv(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+    "Function 'read-csv' passed incorrect number of arguments. "
+    "Got %i, Expected 1 to 3.", a->count);
+  LASSERT_TYPE("read-csv", a, 0, LVAL_STR);
+  if (a->count >= 2) {
+    LASSERT_TYPE("read-csv", a, 1, LVAL_QEXPR);
+    for (int i = 0; i < a->cell[1]->count; i++) {
+      int t = a->cell[1]->cell[i]->type;
+      LASSERT(a, t == LVAL_STR || t == LVAL_NUM,
+        "Function 'read-csv' passed incorrect type for column %i. "
+        "Got %s, Expected String or Number.", i, ltype_name(t));
+    }
+  }
+  if (a->count == 3) { LASSERT_DELIM("read-csv", a, 2); }
+
+  /* Tab separated when the name says so */
+  char* path = a->cell[0]->str;
+  size_t plen = strlen(path);
+  char delim = a->count == 3 ? a->cell[2]->str[0]
+    : plen >= 4 && strcmp(path + plen - 4, ".tsv") == 0 ? '\t' : ',';
+
+  size_t size;
+  char* data = lcsv_load(path, &size);
+  LASSERT(a, data, "Could not open '%s': %s", path, strerror(errno));
+  char* p = data;
+  char* end = data + size;
+
+  /* The first line names the columns */
+  lval* header = lval_qexpr();
+  bool last = p == end;
+  while (!last) {
+    lcsv_field f;
+    p = lcsv_scan(p, end, delim, &f, &last);
+    if (!p) { break; }
+    lval_add(header, lcsv_value(&f, LCSV_STR));
+  }
+
+  int nout = 0;
+  lval* missing = NULL;
+  int* slot = p ? lcsv_project(header, a->count >= 2 && a->cell[1]->count ? a->cell[1] : NULL,
+                               &nout, &missing) : NULL;
+  if (!slot) {
+    lval_del(header);
+    lcsv_unload(data, size);
+    LASSERT(a, missing, "Could not read '%s': unterminated quote in the header.", path);
+    LASSERT(a, missing->type == LVAL_NUM, "Could not read '%s': no column '%s'.", path, missing->str);
+    LASSERT(a, false, "Could not read '%s': no column %li.", path, missing->num);
+  }
+
+  /* Wanted fields row by row, missing ones left empty */
+  size_t rows = 0, cap = 0;
+  lcsv_field* cells = NULL;
+  int* kinds = calloc(nout + 1, sizeof(int));
+  long line = 1;
+  while (p && p < end) {
+    if (*p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n')) {
+      p += *p == '\n' ? 1 : 2;
+      line++;
+      continue;
+    }
+    if (rows == cap) {
+      cap = cap ? cap * 2 : 1024;
+      cells = realloc(cells, sizeof(lcsv_field) * cap * (nout + 1));
+    }
+    lcsv_field* row = cells + rows * nout;
+    for (int j = 0; j < nout; j++) { row[j].len = 0; row[j].quoted = false; }
+
+    last = false;
+    for (int i = 0; !last; i++) {
+      lcsv_field f;
+      p = lcsv_scan(p, end, delim, &f, &last);
+      if (!p) { break; }
+      if (i >= header->count || slot[i] < 0) { continue; }
+      row[slot[i]] = f;
+      int k = lcsv_kind(&f);
+      if (k > kinds[slot[i]]) { kinds[slot[i]] = k; }
+    }
+    rows++;
+    line++;
+  }
+
+  lval* x = NULL;
+  if (p) {
+    x = lval_qexpr();
+    x->count = nout;
+    x->cell = malloc(sizeof(lval*) * nout);
+    lquota_heap(sizeof(lval*) * nout);
+    for (int i = 0; i < header->count; i++) {
+      if (slot[i] < 0) { continue; }
+      int j = slot[i];
+      int kind = kinds[j] == LCSV_EMPTY ? LCSV_STR : kinds[j];
+      lval* col = lval_qexpr();
+      col->count = rows;
+      col->cell = malloc(sizeof(lval*) * (rows + 1));
+      lquota_heap(sizeof(lval*) * rows);
+      for (size_t r = 0; r < rows; r++) { col->cell[r] = lcsv_value(&cells[r * nout + j], kind); }
+      x->cell[j] = lval_add(lval_add(lval_qexpr(), lval_copy(header->cell[i])), col);
+    }
+  }
+
+  free(cells);
+  free(kinds);
+  free(slot);
+  lval_del(header);
+  lcsv_unload(data, size);
+  LASSERT(a, x, "Could not read '%s': unterminated quote on line %li.", path, line);
+
+  lval_del(a);
+  return x;
+}
+
+/* Next record from a port as a list of fields, {} at end of input */
+lval* builtin_read_csv_row(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "Function 'read-csv-row' passed incorrect number of arguments. "
+    "Got %i, Expected 1 or 2.", a->count);
+  LASSERT_TYPE("read-csv-row", a, 0, LVAL_PORT);
+  LASSERT_OPEN("read-csv-row", a, 0);
+  if (a->count == 2) { LASSERT_DELIM("read-csv-row", a, 1); }
+
+  lport* p = a->cell[0]->port;
+  char delim = a->count == 2 ? a->cell[1]->str[0] : ',';
+
+  while (1) {
+    char* start = p->in + p->in_pos;
+    char* end = p->in + p->in_len;
+    while (start < end && (*start == '\n' || *start == '\r')) { start++; }
+    p->in_pos = start - p->in;
+
+    char* q = start;
+    bool last = start == end;
+    while (q && !last) {
+      lcsv_field f;
+      q = lcsv_scan(q, end, delim, &f, &last);
+    }
+
+    /* Until the end of input only a newline ends a record, as quotes span lines */
+    if (start < end && q && (q[-1] == '\n' || p->eof)) {
+      lval* x = lval_qexpr();
+      for (q = start, last = false; !last;) {
+        lcsv_field f;
+        q = lcsv_scan(q, end, delim, &f, &last);
+        int k = lcsv_kind(&f);
+        lval_add(x, lcsv_value(&f, k == LCSV_EMPTY ? LCSV_STR : k));
+      }
+      p->in_pos = q - p->in;
+      lval_del(a);
+      return x;
+    }
+
+    if (lport_fill(p) == 0 && (start == end || !q)) {
+      p->in_pos = p->in_len;
+      LASSERT(a, start == end, "Function 'read-csv-row' found an unterminated quote.");
+      lval_del(a);
+      return lval_qexpr();
+    }
+  }
+}
+
+/* Reloading */
+
+/*
+ * Loaded files are remembered by hashes of their top level forms' text.
+ * Reloading splits the file into forms with a scan for brackets, strings
+ * and comments, then parses and evaluates only the forms whose text wasn't
+ * there last time, in file order. Each occurrence counts, so a copy of a
+ * form that was already there is new. On Linux, watched files are reloaded
+ * when they change, checked before each evaluation starts.
+ */
+
+struct lsource {
+  char* path;
+  char* name;         /* Within its directory, as in watch events */
+  uint64_t* hashes;   /* Sorted with repeats, of the forms evaluated without error */
+  int count;
+  int wd;
+  bool changed;
+  lsource* next;
+};
+
+typedef struct {
+  char* start;
+  long len;
+  int line;
+  uint64_t hash;
+} lsource_form;
+
+uint64_t lsource_hash(char* s, long n) {
+  uint64_t h = 14695981039346656037ull;
+  for (long i = 0; i < n; i++) { h = (h ^ (unsigned char) s[i]) * 1099511628211ull; }
+  return h;
+}
+
+bool lsource_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* Length of the form at s, -1 if a bracket or string is never closed */
+long lsource_form_len(char* s, char* end) {
+  char* p = s;
+  int depth = 0;
+  do {
+    if (p == end) { return -1; }
+    if (*p == '"') {
+      for (p++; p < end && *p != '"'; p++) { if (*p == '\\') { p++; } }
+      if (p >= end) { return -1; }
+      p++;
+    } else if (*p == ';') {
+      while (p < end && *p != '\n') { p++; }
+    } else if (*p == '(' || *p == '{') {
+      depth++; p++;
+    } else if (*p == ')' || *p == '}') {
+      depth--; p++;
+    } else if (depth == 0) {
+      do { p++; } while (p < end && !lsource_space(*p) && !strchr("(){}\";", *p));
+    } else {
+      p++;
+    }
+  } while (depth > 0);
+  return p - s;
+}
+
+/* Top level forms of the text, or NULL with the line of one never closed */
+lsource_form* lsource_split(char* data, size_t size, int* count, int* line) {
+  char* p = data;
+  char* end = data + size;
+  int cap = 64;
+  lsource_form* forms = malloc(sizeof(lsource_form) * cap);
+  *count = 0;
+  *line = 1;
+
+  while (1) {
+    while (p < end && (lsource_space(*p) || *p == ';')) {
+      if (*p == ';') { while (p < end && *p != '\n') { p++; } continue; }
+      *line += *p++ == '\n';
+    }
+    if (p == end) { return forms; }
+
+    long n = lsource_form_len(p, end);
+    if (n < 0) { free(forms); return NULL; }
+    if (*count == cap) { cap *= 2; forms = realloc(forms, sizeof(lsource_form) * cap); }
+    forms[(*count)++] = (lsource_form) { p, n, *line, lsource_hash(p, n) };
+    for (; n > 0; n--) { *line += *p++ == '\n'; }
+  }
+}
+
+int lsource_cmp(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return (x > y) - (x < y);
+}
+
+lsource* lsource_get(char* path) {
+  for (lsource* s = lcur->sources; s; s = s->next) {
+    if (strcmp(s->path, path) == 0) { return s; }
+  }
+  lsource* s = calloc(1, sizeof(lsource));
+  s->path = strdup(path);
+  char* slash = strrchr(s->path, '/');
+  s->name = slash ? slash + 1 : s->path;
+  s->wd = -1;
+  s->next = lcur->sources;
+  lcur->sources = s;
+  return s;
+}
+
+/* Takes ownership of the hashes */
+void lsource_remember(lsource* s, uint64_t* hashes, int count) {
+  if (count) { qsort(hashes, count, sizeof(uint64_t), lsource_cmp); }
+  free(s->hashes);
+  s->hashes = hashes;
+  s->count = count;
+}
+
+/* Match one remembered occurrence of hash not matched yet, false if none is left */
+bool lsource_take(lsource* s, uint64_t hash, bool* taken) {
+  int lo = 0, hi = s->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (s->hashes[mid] < hash) { lo = mid + 1; } else { hi = mid; }
+  }
+  for (; lo < s->count && s->hashes[lo] == hash; lo++) {
+    if (!taken[lo]) { taken[lo] = true; return true; }
+  }
+  return false;
+}
+
+/* Remember every form of a file just loaded */
+void lsource_record(char* path) {
+  size_t size;
+  char* data = lcsv_load(path, &size);
+  if (!data) { return; }
+
+  int count, line;
+  lsource_form* forms = lsource_split(data, size, &count, &line);
+  if (forms) {
+    uint64_t* hashes = malloc(sizeof(uint64_t) * (count + 1));
+    for (int i = 0; i < count; i++) { hashes[i] = forms[i].hash; }
+    lsource_remember(lsource_get(path), hashes, count);
+    free(forms);
+  }
+  lcsv_unload(data, size);
+}
+
+/* Evaluate the forms that changed, giving how many there were */
+lval* lsource_reload(lenv* e, char* path) {
+  size_t size;
+  char* data = lcsv_load(path, &size);
+  if (!data) { return lval_err("Could not open '%s': %s", path, strerror(errno)); }
+
+  int count, line;
+  lsource_form* forms = lsource_split(data, size, &count, &line);
+  if (!forms) {
+    lcsv_unload(data, size);
+    return lval_err("Could not reload '%s': expression on line %i is never closed.", path, line);
+  }
+
+  lsource* s = lsource_get(path);
+  bool* taken = calloc(s->count + 1, sizeof(bool));
+  uint64_t* hashes = malloc(sizeof(uint64_t) * (count + 1));
+  int kept = 0;
+  long changed = 0;
+  lval* stop = NULL;
+
+  for (int i = 0; i < count && !stop; i++) {
+    lsource_form* f = &forms[i];
+    if (lsource_take(s, f->hash, taken)) { hashes[kept++] = f->hash; continue; }
+    changed++;
+
+    /* Parsed on its own, after blank lines so errors give the right line */
+    char* text = malloc(f->line - 1 + f->len + 1);
+    memset(text, '\n', f->line - 1);
+    memcpy(text + f->line - 1, f->start, f->len);
+    text[f->line - 1 + f->len] = '\0';
+    mpc_result_t r;
+    bool parsed = mpc_parse(path, text, lcur->Lispy, &r);
+    free(text);
+
+    int failed = 0;
+    lval* x = lenv_load_parsed(e, path, parsed, &r, &failed);
+    if (lcur->exited || lcur->breach) { stop = x; break; }
+    if (x->type == LVAL_ERR) { lval_println(x); }
+    if (x->type != LVAL_ERR && !failed) { hashes[kept++] = f->hash; }
+    lval_del(x);
+  }
+
+  free(taken);
+  free(forms);
+  lcsv_unload(data, size);
+
+  /* Forms after a stop were never evaluated, so keep the old record */
+  if (stop) { free(hashes); return stop; }
+  lsource_remember(s, hashes, kept);
+  return lval_num(changed);
+}
+
+/* Reload the watched files that changed since the last check */
+void lsource_poll(lenv* e) {
+#ifdef __linux__
+  if (lcur->watch_fd < 0) { return; }
+
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool any = false;
+  ssize_t n;
+  while ((n = read(lcur->watch_fd, buf, sizeof(buf))) > 0) {
+    struct inotify_event* ev;
+    for (char* p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event*) p;
+      for (lsource* s = lcur->sources; s; s = s->next) {
+        if (s->wd == ev->wd && ev->len && strcmp(s->name, ev->name) == 0) {
+          s->changed = any = true;
+        }
+      }
+    }
+  }
+
+  for (lsource* s = lcur->sources; any && s && !lcur->exited; s = s->next) {
+    if (!s->changed) { continue; }
+    s->changed = false;
+    lquota_start();
+    lval* x = lsource_reload(e, s->path);
+    if (x->type == LVAL_NUM) {
+      lbuf_printf(&lcur->out->out, "Reloaded '%s' (%li changed)\n", s->path, x->num);
+    } else if (!lcur->exited) {
+      lval_println(x);
+    }
+    lval_del(x);
+  }
+#endif
+}
+
+void lsource_free(void) {
+  while (lcur->sources) {
+    lsource* s = lcur->sources;
+    lcur->sources = s->next;
+    free(s->path);
+    free(s->hashes);
+    free(s);
+  }
+#ifdef __linux__
+  if (lcur->watch_fd >= 0) { close(lcur->watch_fd); }
+#endif
+}
+
+lval* builtin_reload(lenv* e, lval* a) {
+  LASSERT_NUM("reload", a, 1);
+  LASSERT_TYPE("reload", a, 0, LVAL_STR);
+
+  lval* x = lsource_reload(e, a->cell[0]->str);
+  lval_del(a);
+  return x;
+}
+
+#ifdef __linux__
+
+lval* builtin_watch(lenv* e, lval* a) {
+  LASSERT_NUM("watch", a, 1);
+  LASSERT_TYPE("watch", a, 0, LVAL_STR);
+  char* path = a->cell[0]->str;
+
+  /* Watch the directory, as editors often save by replacing the file */
+  if (lcur->watch_fd < 0) { lcur->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC); }
+  char* slash = strrchr(path, '/');
+  char* dir = slash == path ? strdup("/")
+            : slash ? strndup(path, slash - path) : strdup(".");
+  int wd = lcur->watch_fd < 0 ? -1
+         : inotify_add_watch(lcur->watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+  free(dir);
+  LASSERT(a, wd >= 0, "Could not watch '%s': %s", path, strerror(errno));
+  lsource_get(path)->wd = wd;
+
+  lval* x = lsource_reload(e, path);
+  lval_del(a);
+  return x;
+}
+
+#else
+
+lval* builtin_watch(lenv* e, lval* a) {
+  lval_del(a);
+  return lval_err("Function 'watch' isn't supported on this system.");
+}
+
+#endif
+
+/* Coroutines */
+
+/*
+ * Tasks are green threads scheduled cooperatively on the thread of their
+ * context. Each runs on its own stack, reserved up front but only committed
+ * as it is touched, and switches back to the scheduler whenever it yields or
+ * blocks on a channel. The scheduler runs while the main program yields,
+ * blocks on a channel, or has finished.
+ */
+
+#define LTASK_STACK (1 << 20)
+
+struct lchan {
+  int refs;
+  lval** items;
+  int cap;
+  int head;
+  int count;
+  bool closed;
+};
+
+lchan* lchan_new(int cap) {
+  lchan* c = malloc(sizeof(lchan));
+  c->refs = 1;
+  c->items = malloc(sizeof(lval*) * cap);
+  c->cap = cap;
+  c->head = 0;
+  c->count = 0;
+  c->closed = false;
+  return c;
+}
+
+lchan* lchan_ref(lchan* c) {
+  c->refs++;
+  return c;
+}
+
+void lchan_release(lchan* c) {
+  if (--c->refs > 0) { return; }
+  for (int i = 0; i < c->count; i++) { lval_del(c->items[(c->head + i) % c->cap]); }
+  free(c->items);
+  free(c);
+}
+
+/* What a task being cancelled gets from the call it was blocked in */
+lval* ltask_cancelled(void) {
+  return lval_err_code(LERR_EXIT, "Task cancelled");
+}
+
+#ifndef _WIN32
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+typedef struct ltask {
+  ucontext_t uc;
+  char* stack;
+  long id;
+  lenv* env;
+  lval* f;
+  lval* args;
+  long depth;
+  uint32_t site;
+  bool started;
+  bool done;
+  struct ltask* next;
+} ltask;
+
+struct lsched {
+  ucontext_t main;
+  ltask* tasks;
+  ltask* last;
+  ltask* current;
+  long ids;
+  long progress;
+
+  /* Set while tearing down, when blocked tasks are resumed to unwind */
+  bool cancel;
+};
+
+bool lsched_in_task(void) {
+  return lcur->sched && lcur->sched->current;
+}
+
+void lsched_progress(void) {
+  if (lcur->sched) { lcur->sched->progress++; }
+}
+
+void ltask_run(void) {
+  lsched* s = lcur->sched;
+  ltask* t = s->current;
+
+  lval* x = lval_call(t->env, t->f, t->args);
+  t->args = NULL;
+  if (x->type == LVAL_ERR && !lcur->exited && !s->cancel) {
+    lbuf_flush(&lcur->out->out);
+    lbuf_printf(&lcur->err->out, "Task %li: ", t->id);
+    lval_print(&lcur->err->out, x);
+    lbuf_putc(&lcur->err->out, '\n');
+    lbuf_flush(&lcur->err->out);
+  }
+  lval_del(x);
+
+  t->done = true;
+  s->progress++;
+  /* Returning resumes the scheduler through uc_link */
+}
+
+void ltask_free(ltask* t) {
+  if (!t->started) { lval_del(t->args); }
+  if (!t->started || t->done) { lval_del(t->f); }
+  munmap(t->stack, LTASK_STACK);
+  free(t);
+}
+
+/* Switch from the scheduler into a task until it yields or finishes */
+void ltask_switch(ltask* t) {
+  lsched* s = lcur->sched;
+  long depth = lstats.depth;
+  uint32_t site = lcur->site;
+  uintptr_t limit = lcur->stack_limit;
+  s->current = t;
+  t->started = true;
+  lstats.depth = t->depth;
+  lcur->site = t->site;
+  lcur->stack_limit = (uintptr_t) t->stack + LSTACK_MARGIN;
+
+  swapcontext(&s->main, &t->uc);
+
+  t->depth = lstats.depth;
+  t->site = lcur->site;
+  lstats.depth = depth;
+  lcur->site = site;
+  lcur->stack_limit = limit;
+  s->current = NULL;
+}
+
+/* False once the task is being cancelled, when it should unwind instead */
+bool ltask_yield(void) {
+  lsched* s = lcur->sched;
+  if (s->cancel) { return false; }
+  swapcontext(&s->current->uc, &s->main);
+  return !s->cancel;
+}
+
+
+/* Run every task once, returning whether any of them got anywhere */
+bool lsched_round(void) {
+  lsched* s = lcur->sched;
+  if (!s || !s->tasks) { return false; }
+
+  long progress = s->progress;
+  ltask** p = &s->tasks;
+  ltask* prev = NULL;
+  while (*p && !lcur->exited) {
+    ltask* t = *p;
+    ltask_switch(t);
+    if (t->done) {
+      *p = t->next;
+      if (s->last == t) { s->last = prev; }
+      ltask_free(t);
+    } else {
+      prev = t;
+      p = &t->next;
+    }
+  }
+  return s->progress != progress;
+}
+
+/* Run tasks until they all finish or none of them can make progress */
+void lsched_drain(void) {
+  while (!lcur->exited && lsched_round()) {}
+}
+
+void lsched_free(void) {
+  lsched* s = lcur->sched;
+  if (!s) { return; }
+
+  /* Blocked tasks are resumed with an error, so their frames release what they hold */
+  s->cancel = true;
+  while (s->tasks) {
+    ltask* t = s->tasks;
+    if (t->started && !t->done) { ltask_switch(t); }
+    s->tasks = t->next;
+    ltask_free(t);
+  }
+  free(s);
+  lcur->sched = NULL;
+}
+
+lval* builtin_spawn(lenv* e, lval* a) {
+  LASSERT_CODE(a, a->count >= 1, LERR_ARITY,
+    "Function 'spawn' passed incorrect number of arguments. Got %i, Expected at least 1.",
+    a->count);
+  LASSERT_TYPE("spawn", a, 0, LVAL_FUN);
+
+  char* stack = mmap(NULL, LTASK_STACK, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  LASSERT(a, stack != MAP_FAILED, "Could not allocate a task stack.");
+
+  /* Guard page, so overflowing the stack faults instead of corrupting */
+  mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+  if (!lcur->sched) { lcur->sched = calloc(1, sizeof(lsched)); }
+  lsched* s = lcur->sched;
+
+  ltask* t = malloc(sizeof(ltask));
+  getcontext(&t->uc);
+  t->uc.uc_stack.ss_sp = stack;
+  t->uc.uc_stack.ss_size = LTASK_STACK;
+  t->uc.uc_link = &s->main;
+  makecontext(&t->uc, ltask_run, 0);
+
+  t->stack = stack;
+  t->id = ++s->ids;
+  t->env = lenv_top(e);
+  t->f = lval_pop(a, 0);
+  t->args = a;
+  t->depth = 0;
+  t->site = lcur->site;
+  t->started = false;
+  t->done = false;
+  t->next = NULL;
+
+  if (s->last) { s->last->next = t; } else { s->tasks = t; }
+  s->last = t;
+  s->progress++;
+
+  return lval_num(t->id);
+}
+
+#else
+
+bool lsched_in_task(void) { return false; }
+void lsched_progress(void) {}
+bool ltask_yield(void) { return true; }
+bool lsched_round(void) { return false; }
+void lsched_drain(void) {}
+void lsched_free(void) {}
+
+#endif
+
+lval* builtin_yield(lenv* e, lval* a) {
+  lval_no_args(a);
+  LASSERT_NUM("yield", a, 0);
+  lval_del(a);
+
+  if (lsched_in_task()) {
+    lsched_progress();
+    if (!ltask_yield()) { return ltask_cancelled(); }
+  } else {
+    lsched_round();
+  }
+  return lval_sexpr();
+}
+
+/* Block until the channel can be sent to or received from, running other tasks */
+lval* lchan_wait(lchan* c, bool sending) {
+  while (!c->closed && (sending ? c->count == c->cap : c->count == 0)) {
+    if (lsched_in_task()) {
+      if (!ltask_yield()) { return ltask_cancelled(); }
+      continue;
+    }
+    if (lcur->exited) { return lval_err_code(LERR_EXIT, "Exit"); }
+    if (!lsched_round()) {
+      return lval_err("Deadlock: no task can %s the channel.", sending ? "receive from" : "send to");
+    }
+  }
+  return NULL;
+}
+
+lval* builtin_chan_new(lenv* e, lval* a) {
+  lval_no_args(a);
+  LASSERT_CODE(a, a->count <= 1, LERR_ARITY,
+    "Function 'chan-new' passed incorrect number of arguments. Got %i, Expected 0 or 1.",
+    a->count);
+  if (a->count == 1) {
+    LASSERT_TYPE("chan-new", a, 0, LVAL_NUM);
+    LASSERT(a, a->cell[0]->num > 0 && a->cell[0]->num <= INT_MAX,
+      "Function 'chan-new' passed invalid capacity %li.", a->cell[0]->num);
+  }
+
+  int cap = a->count ? (int) a->cell[0]->num : 1;
+  lval_del(a);
+  return lval_chan(lchan_new(cap));
+}
+
+lval* builtin_chan_send(lenv* e, lval* a) {
+  LASSERT_NUM("chan-send", a, 2);
+  LASSERT_TYPE("chan-send", a, 0, LVAL_CHAN);
+
+  lchan* c = a->cell[0]->chan;
+  lval* err = lchan_wait(c, true);
+  if (err) { lval_del(a); return err; }
+  LASSERT(a, !c->closed, "Function 'chan-send' passed closed channel.");
+
+  c->items[(c->head + c->count) % c->cap] = lval_pop(a, 1);
+  c->count++;
+  lsched_progress();
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Empty list signals a closed and drained channel */
+lval* builtin_chan_recv(lenv* e, lval* a) {
+  LASSERT_NUM("chan-recv", a, 1);
+  LASSERT_TYPE("chan-recv", a, 0, LVAL_CHAN);
+
+  lchan* c = a->cell[0]->chan;
+  lval* err = lchan_wait(c, false);
+  if (err) { lval_del(a); return err; }
+
+  lval* x;
+  if (c->count) {
+    x = c->items[c->head];
+    c->head = (c->head + 1) % c->cap;
+    c->count--;
+    lsched_progress();
+  } else {
+    x = lval_qexpr();
+  }
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_chan_close(lenv* e, lval* a) {
+  LASSERT_NUM("chan-close", a, 1);
+  LASSERT_TYPE("chan-close", a, 0, LVAL_CHAN);
+
+  a->cell[0]->chan->closed = true;
+  lsched_progress();
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* Asynchronous I/O */
+
+/*
+ * Whole-file reads and writes run in the background while evaluation goes
+ * on, through io_uring where the kernel allows it and a small pool of
+ * threads otherwise. Requests are named by number. Awaiting one from a task
+ * lets other tasks run; from the main program it runs tasks, then blocks.
+ * Files are opened when the request is made, so a missing file is reported
+ * right away.
+ */
+
+#ifndef _WIN32
+
+#define LAIO_ENTRIES 256
+#define LAIO_THREADS 4
+
+enum { LAIO_READ, LAIO_WRITE };
+
+typedef struct laio_req {
+  long id;
+  int op;
+  int fd;
+  char* data;
+  size_t len;
+  size_t cap;
+  size_t size;
+  bool regular;
+  bool complete;
+  bool pooled;
+  bool awaited;
+  int err;
+  struct laio_req* next;
+  struct laio_req* queue;
+} laio_req;
+
+struct laio {
+  long ids;
+  laio_req* reqs;
+  int inflight;
+
+  /* io_uring, ring_fd is -1 when unavailable */
+  int ring_fd;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+#ifdef LURING
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+#endif
+
+  /* Thread pool, for when io_uring is unavailable or refuses a request */
+  bool pool;
+  pthread_t threads[LAIO_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  laio_req* queue;
+  bool stop;
+};
+
+/* Account for n transferred bytes, returning whether the request is finished */
+bool laio_advance(laio_req* r, long n) {
+  if (n < 0) { r->err = (int) -n; return true; }
+  r->len += n;
+  if (r->op == LAIO_WRITE) { return n == 0 || r->len == r->size; }
+
+  if (n == 0 || (r->regular && r->len >= r->size)) { return true; }
+  if (r->len == r->cap) {
+    r->cap *= 2;
+    r->data = realloc(r->data, r->cap);
+  }
+  return false;
+}
+
+void laio_blocking(laio_req* r) {
+  bool finished = false;
+  while (!finished) {
+    ssize_t n = r->op == LAIO_READ
+      ? pread(r->fd, r->data + r->len, r->cap - r->len, r->len)
+      : pwrite(r->fd, r->data + r->len, r->size - r->len, r->len);
+    if (n < 0 && errno == EINTR) { continue; }
+    finished = laio_advance(r, n < 0 ? -errno : n);
+  }
+}
+
+void* laio_worker(void* arg) {
+  laio* io = arg;
+  pthread_mutex_lock(&io->lock);
+  while (!io->stop) {
+    laio_req* r = io->queue;
+    if (!r) { pthread_cond_wait(&io->work, &io->lock); continue; }
+    io->queue = r->queue;
+
+    pthread_mutex_unlock(&io->lock);
+    laio_blocking(r);
+    pthread_mutex_lock(&io->lock);
+
+    r->complete = true;
+    pthread_cond_broadcast(&io->done);
+  }
+  pthread_mutex_unlock(&io->lock);
+  return NULL;
+}
+
+#ifdef LURING
+
+bool laio_ring_setup(laio* io) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  io->ring_fd = syscall(__NR_io_uring_setup, LAIO_ENTRIES, &p);
+  if (io->ring_fd < 0) { return false; }
+
+  io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  io->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+  io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+  io->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+
+  if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+    close(io->ring_fd);
+    io->ring_fd = -1;
+    return false;
+  }
+
+  char* sq = io->sq_ring;
+  char* cq = io->cq_ring;
+  io->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+  io->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+  io->sq_array = (unsigned*) (sq + p.sq_off.array);
+  io->cq_head = (unsigned*) (cq + p.cq_off.head);
+  io->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+  io->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+  return true;
+}
+
+/* io_uring_enter, retried when interrupted. Returns 0 or -errno */
+int laio_ring_enter(laio* io, unsigned submit, unsigned wait, unsigned flags) {
+  while (syscall(__NR_io_uring_enter, io->ring_fd, submit, wait, flags, NULL, 0) < 0) {
+    if (errno != EINTR) { return -errno; }
+  }
+  return 0;
+}
+
+/* False if the kernel refused the request, which is then taken back off the ring */
+bool laio_ring_submit(laio* io, laio_req* r) {
+  unsigned tail = *io->sq_tail;
+  unsigned index = tail & *io->sq_mask;
+  struct io_uring_sqe* sqe = &io->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = r->fd;
+  sqe->off = r->len;
+  sqe->user_data = (unsigned long) r;
+  if (r->op == LAIO_READ) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->addr = (unsigned long) (r->data + r->len);
+    sqe->len = r->cap - r->len;
+  } else {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->addr = (unsigned long) (r->data + r->len);
+    sqe->len = r->size - r->len;
+  }
+
+  io->sq_array[index] = index;
+  __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  if (laio_ring_enter(io, 1, 0, 0) == 0) { return true; }
+
+  /* Nothing was consumed, and nobody else adds entries */
+  __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+  return false;
+}
+
+void laio_pool_submit(laio* io, laio_req* r);
+
+/* Put r on the ring, or on the thread pool if the ring won't take it */
+void laio_ring_queue(laio* io, laio_req* r) {
+  if (laio_ring_submit(io, r)) { return; }
+  io->inflight--;
+  laio_pool_submit(io, r);
+}
+
+/* Handle finished operations, waiting for at least one if asked */
+void laio_ring_reap(laio* io, bool wait) {
+  if (wait) { laio_ring_enter(io, 0, 1, IORING_ENTER_GETEVENTS); }
+
+  unsigned head = *io->cq_head;
+  while (head != __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &io->cqes[head & *io->cq_mask];
+    laio_req* r = (laio_req*) (unsigned long) cqe->user_data;
+    int res = cqe->res;
+    head++;
+    __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+
+    if (res == -EINTR || res == -EAGAIN) {
+      laio_ring_queue(io, r);
+    } else if (laio_advance(r, res)) {
+      r->complete = true;
+      io->inflight--;
+    } else {
+      laio_ring_queue(io, r);
+    }
+  }
+}
+
+#else
+
+bool laio_ring_setup(laio* io) { io->ring_fd = -1; return false; }
+void laio_ring_queue(laio* io, laio_req* r) {}
+void laio_ring_reap(laio* io, bool wait) {}
+
+#endif
+
+void laio_pool_start(laio* io) {
+  if (io->pool) { return; }
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->work, NULL);
+  pthread_cond_init(&io->done, NULL);
+  for (int i = 0; i < LAIO_THREADS; i++) {
+    pthread_create(&io->threads[i], NULL, laio_worker, io);
+  }
+  io->pool = true;
+}
+
+laio* laio_get(void) {
+  if (lcur->aio) { return lcur->aio; }
+
+  laio* io = calloc(1, sizeof(laio));
+  if (!laio_ring_setup(io)) { laio_pool_start(io); }
+
+  lcur->aio = io;
+  return io;
+}
+
+void laio_pool_submit(laio* io, laio_req* r) {
+  laio_pool_start(io);
+  r->pooled = true;
+
+  pthread_mutex_lock(&io->lock);
+  laio_req** q = &io->queue;
+  while (*q) { q = &(*q)->queue; }
+  r->queue = NULL;
+  *q = r;
+  pthread_cond_signal(&io->work);
+  pthread_mutex_unlock(&io->lock);
+}
+
+void laio_submit(laio* io, laio_req* r) {
+  if (io->ring_fd >= 0) {
+    /* Keep within the ring, completions free up entries */
+    while (io->inflight == LAIO_ENTRIES) { laio_ring_reap(io, true); }
+    io->inflight++;
+    laio_ring_queue(io, r);
+    return;
+  }
+  laio_pool_submit(io, r);
+}
+
+bool laio_complete(laio* io, laio_req* r, bool wait) {
+  if (io->ring_fd >= 0) {
+    laio_ring_reap(io, false);
+    while (wait && !r->complete && !r->pooled) { laio_ring_reap(io, true); }
+    if (!r->pooled) { return r->complete; }
+  }
+
+  pthread_mutex_lock(&io->lock);
+  while (wait && !r->complete) { pthread_cond_wait(&io->done, &io->lock); }
+  bool complete = r->complete;
+  pthread_mutex_unlock(&io->lock);
+  return complete;
+}
+
+laio_req* laio_find(laio* io, long id, laio_req*** link) {
+  for (laio_req** p = &io->reqs; *p; p = &(*p)->next) {
+    if ((*p)->id == id) {
+      if (link) { *link = p; }
+      return *p;
+    }
+  }
+  return NULL;
+}
+
+void laio_req_free(laio_req* r) {
+  close(r->fd);
+  free(r->data);
+  free(r);
+}
+
+/* Outstanding requests are finished before their buffers are released */
+void laio_free(void) {
+  laio* io = lcur->aio;
+  if (!io) { return; }
+
+  while (io->reqs) {
+    laio_req* r = io->reqs;
+    laio_complete(io, r, true);
+    io->reqs = r->next;
+    laio_req_free(r);
+  }
+
+  if (io->ring_fd >= 0) {
+    munmap(io->sq_ring, io->sq_ring_size);
+    munmap(io->cq_ring, io->cq_ring_size);
+#ifdef LURING
+    munmap(io->sqes, LAIO_ENTRIES * sizeof(struct io_uring_sqe));
+#endif
+    close(io->ring_fd);
+  }
+  if (io->pool) {
+    pthread_mutex_lock(&io->lock);
+    io->stop = true;
+    pthread_cond_broadcast(&io->work);
+    pthread_mutex_unlock(&io->lock);
+    for (int i = 0; i < LAIO_THREADS; i++) { pthread_join(io->threads[i], NULL); }
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->work);
+    pthread_cond_destroy(&io->done);
+  }
+
+  free(io);
+  lcur->aio = NULL;
+}
+
+lval* laio_start(lval* a, char* path, int op, int flags) {
+  int fd = open(path, flags, 0644);
+  LASSERT(a, fd >= 0, "Could not open '%s': %s", path, strerror(errno));
+
+  struct stat st;
+  if (op == LAIO_READ && fstat(fd, &st) != 0) {
+    lval* err = lval_err("Could not read '%s': %s", path, strerror(errno));
+    close(fd);
+    lval_del(a);
+    return err;
+  }
+
+  laio* io = laio_get();
+  laio_req* r = calloc(1, sizeof(laio_req));
+  r->id = ++io->ids;
+  r->op = op;
+  r->fd = fd;
+
+  if (op == LAIO_READ) {
+    r->regular = S_ISREG(st.st_mode);
+    r->size = st.st_size;
+    r->cap = r->size + 1 > 4096 ? r->size + 1 : 4096;
+    r->data = malloc(r->cap);
+  } else {
+    r->size = strlen(a->cell[1]->str);
+    r->cap = r->size;
+    r->data = malloc(r->size + 1);
+    memcpy(r->data, a->cell[1]->str, r->size);
+  }
+
+  r->next = io->reqs;
+  io->reqs = r;
+  laio_submit(io, r);
+
+  lval_del(a);
+  return lval_num(r->id);
+}
+
+lval* builtin_async_read(lenv* e, lval* a) {
+  LASSERT_NUM("async-read", a, 1);
+  LASSERT_TYPE("async-read", a, 0, LVAL_STR);
+  return laio_start(a, a->cell[0]->str, LAIO_READ, O_RDONLY);
+}
+
+lval* builtin_async_write(lenv* e, lval* a) {
+  LASSERT_NUM("async-write", a, 2);
+  LASSERT_TYPE("async-write", a, 0, LVAL_STR);
+  LASSERT_TYPE("async-write", a, 1, LVAL_STR);
+  return laio_start(a, a->cell[0]->str, LAIO_WRITE, O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+lval* builtin_async_ready(lenv* e, lval* a) {
+  LASSERT_NUM("async-ready", a, 1);
+  LASSERT_TYPE("async-ready", a, 0, LVAL_NUM);
+
+  laio* io = laio_get();
+  laio_req* r = laio_find(io, a->cell[0]->num, NULL);
+  LASSERT(a, r, "Function 'async-ready' passed unknown request %li.", a->cell[0]->num);
+
+  bool complete = laio_complete(io, r, false);
+  lval_del(a);
+  return lval_bln(complete);
+}
+
+/* A read gives the file contents, a write the number of bytes written */
+lval* builtin_async_await(lenv* e, lval* a) {
+  LASSERT_NUM("async-await", a, 1);
+  LASSERT_TYPE("async-await", a, 0, LVAL_NUM);
+
+  laio* io = laio_get();
+  long id = a->cell[0]->num;
+  laio_req* r = laio_find(io, id, NULL);
+  LASSERT(a, r, "Function 'async-await' passed unknown request %li.", id);
+  LASSERT(a, !r->awaited, "Function 'async-await' passed request %li, which is already awaited.", id);
+  lval_del(a);
+  r->awaited = true;
+
+  /* Let other tasks run before blocking the thread */
+  while (!laio_complete(io, r, false)) {
+    if (lsched_in_task()) {
+      /* A cancelled task waits for its request, which owns the buffer */
+      if (!ltask_yield()) { laio_complete(io, r, true); }
+    } else if (!lsched_round()) {
+      laio_complete(io, r, true);
+    }
+  }
+
+  /* Other tasks may have added or removed requests while this one waited */
+  laio_req** link;
+  laio_find(io, id, &link);
+  *link = r->next;
+  lval* x;
+  if (r->err) {
+    x = lval_err("Could not %s file: %s", r->op == LAIO_READ ? "read" : "write", strerror(r->err));
+  } else if (r->op == LAIO_READ) {
+    x = lval_strn(r->data, r->len);
+  } else {
+    x = lval_num(r->len);
+  }
+
+  laio_req_free(r);
+  return x;
+}
+
+#else
+
+void laio_free(void) {}
+
+#endif
+
+/* Serialization */
+
+/*
+ * Values are saved in a versioned binary format: a header, a table of every
+ * distinct string and symbol, then the value as a tagged tree. Numbers are
+ * stored in native byte order, lists and strings are length prefixed, and
+ * builtins are stored by the name they are bound to. Restoring maps the file
+ * and reads it in place, copying each string once into its value.
+ */
+
+#define LSER_MAGIC "LTHB"
+#define LSER_VERSION 2
+
+enum { LSER_NUM, LSER_DEC, LSER_SYM, LSER_STR, LSER_BOOL, LSER_SEXPR,
+       LSER_QEXPR, LSER_LAMBDA, LSER_PARTIAL, LSER_BUILTIN, LSER_CLOSURE };
+
+typedef struct {
+  char** keys;
+  uint32_t* index;
+  uint32_t cap;
+  uint32_t count;
+  char** order;
+} lstrtab;
+
+uint32_t lstrtab_hash(char* s) {
+  uint32_t h = 2166136261u;
+  for (; *s; s++) { h = (h ^ (unsigned char) *s) * 16777619u; }
+  return h;
+}
+
+/* Index of s in the table, adding it if asked, UINT32_MAX if absent */
+uint32_t lstrtab_intern(lstrtab* t, char* s, bool add) {
+  if (add && (t->count + 1) * 2 > t->cap) {
+    lstrtab old = *t;
+    t->cap = t->cap ? t->cap * 2 : 64;
+    t->keys = calloc(t->cap, sizeof(char*));
+    t->index = malloc(sizeof(uint32_t) * t->cap);
+    t->order = NULL;
+    t->count = 0;
+    for (uint32_t i = 0; i < old.count; i++) { lstrtab_intern(t, old.order[i], true); }
+    free(old.keys);
+    free(old.index);
+    free(old.order);
+  }
+
+  uint32_t i = t->cap ? lstrtab_hash(s) & (t->cap - 1) : 0;
+  for (; t->cap && t->keys[i]; i = (i + 1) & (t->cap - 1)) {
+    if (strcmp(t->keys[i], s) == 0) { return t->index[i]; }
+  }
+  if (!add) { return UINT32_MAX; }
+
+  t->keys[i] = s;
+  t->index[i] = t->count;
+  if (t->count % 64 == 0) { t->order = realloc(t->order, sizeof(char*) * (t->count + 64)); }
+  t->order[t->count] = s;
+  return t->count++;
+}
+
+void lstrtab_free(lstrtab* t) {
+  free(t->keys);
+  free(t->index);
+  free(t->order);
+}
+
+#ifndef _WIN32
+
+/* Name a builtin is bound to, searching outwards from e */
+char* lser_builtin_name(lenv* e, lbuiltin f) {
+  for (; e; e = e->par) {
+    for (int i = 0; i < e->count; i++) {
+      if (e->vals[i]->type == LVAL_FUN && e->vals[i]->builtin == f) { return e->syms[i]; }
+    }
+  }
+  return NULL;
+}
+
+/* First pass, collecting strings and rejecting what can't be saved */
+lval* lser_collect(lenv* e, lstrtab* t, lval* v) {
+  lstack s;
+  lstack_init(&s);
+
+  lval* err = NULL;
+  for (; v && !err; v = s.count ? lstack_pop(&s) : NULL) {
+    switch (v->type) {
+      case LVAL_NUM: case LVAL_DEC: case LVAL_BOOL: break;
+      case LVAL_SYM: lstrtab_intern(t, v->sym, true); break;
+      case LVAL_STR: lstrtab_intern(t, v->str, true); break;
+      case LVAL_FUN:
+        if (v->builtin) {
+          char* name = lser_builtin_name(e, v->builtin);
+          if (!name) { err = lval_err("Cannot save a builtin that is not bound to a name."); break; }
+          lstrtab_intern(t, name, true);
+        } else if (v->callee) {
+          for (int i = v->count - 1; i >= 0; i--) { lstack_push(&s, v->cell[i]); }
+          lstack_push(&s, v->callee);
+        } else {
+          for (int i = 0; v->caps && i < v->caps->count; i++) {
+            lstrtab_intern(t, v->caps->syms[i], true);
+            lstack_push(&s, v->caps->vals[i]);
+          }
+          lstack_push2(&s, v->body, v->formals);
+        }
+      break;
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+        for (int i = v->count - 1; i >= 0; i--) { lstack_push(&s, v->cell[i]); }
+      break;
+      default: err = lval_err("Cannot save a value of type %s.", ltype_name(v->type));
+    }
+  }
+
+  lstack_free(&s);
+  return err;
+}
+
+void lser_u8(lbuf* b, uint8_t x) { lbuf_putc(b, (char) x); }
+void lser_u32(lbuf* b, uint32_t x) { lbuf_write(b, (char*) &x, 4); }
+void lser_u64(lbuf* b, uint64_t x) { lbuf_write(b, (char*) &x, 8); }
+
+/* What waits on the stack to be written: a value, or a count or captured name between values */
+enum { LSER_PUT_VAL, LSER_PUT_COUNT, LSER_PUT_NAME };
+
+void lser_put(lstack* s, void* x, int kind) { lstack_push2(s, x, (void*) (uintptr_t) kind); }
+
+void lser_write(lenv* e, lstrtab* t, lbuf* b, lval* v) {
+  lstack s;
+  lstack_init(&s);
+  lser_put(&s, v, LSER_PUT_VAL);
+
+  /* Parts are pushed last first, to come out in the order they're read back */
+  while (s.count) {
+    int kind = (uintptr_t) lstack_pop(&s);
+    void* x = lstack_pop(&s);
+    if (kind == LSER_PUT_COUNT) { lser_u32(b, (uintptr_t) x); continue; }
+    if (kind == LSER_PUT_NAME) {
+      lser_u8(b, LSER_SYM);
+      lser_u32(b, lstrtab_intern(t, x, false));
+      continue;
+    }
+
+    v = x;
+    switch (v->type) {
+      case LVAL_NUM: lser_u8(b, LSER_NUM); lser_u64(b, (uint64_t) v->num); break;
+      case LVAL_DEC: {
+        uint64_t bits;
+        memcpy(&bits, &v->dec, 8);
+        lser_u8(b, LSER_DEC);
+        lser_u64(b, bits);
+      }
+      break;
+      case LVAL_BOOL: lser_u8(b, LSER_BOOL); lser_u8(b, strcmp(v->bln, "true") == 0); break;
+      case LVAL_SYM: lser_u8(b, LSER_SYM); lser_u32(b, lstrtab_intern(t, v->sym, false)); break;
+      case LVAL_STR: lser_u8(b, LSER_STR); lser_u32(b, lstrtab_intern(t, v->str, false)); break;
+      case LVAL_FUN:
+        if (v->builtin) {
+          lser_u8(b, LSER_BUILTIN);
+          lser_u32(b, lstrtab_intern(t, lser_builtin_name(e, v->builtin), false));
+        } else if (v->callee) {
+          lser_u8(b, LSER_PARTIAL);
+          for (int i = v->count - 1; i >= 0; i--) { lser_put(&s, v->cell[i], LSER_PUT_VAL); }
+          lser_put(&s, (void*) (uintptr_t) v->count, LSER_PUT_COUNT);
+          lser_put(&s, v->callee, LSER_PUT_VAL);
+        } else {
+          /* A flag for macros, then the code. Closures are followed by their captured
+           * symbols and values */
+          lser_u8(b, v->caps ? LSER_CLOSURE : LSER_LAMBDA);
+          lser_u8(b, v->macro);
+          for (int i = v->caps ? v->caps->count - 1 : -1; i >= 0; i--) {
+            lser_put(&s, v->caps->vals[i], LSER_PUT_VAL);
+            lser_put(&s, v->caps->syms[i], LSER_PUT_NAME);
+          }
+          if (v->caps) { lser_put(&s, (void*) (uintptr_t) v->caps->count, LSER_PUT_COUNT); }
+          lser_put(&s, v->body, LSER_PUT_VAL);
+          lser_put(&s, v->formals, LSER_PUT_VAL);
+        }
+      break;
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+        lser_u8(b, v->type == LVAL_SEXPR ? LSER_SEXPR : LSER_QEXPR);
+        lser_u32(b, v->count);
+        for (int i = v->count - 1; i >= 0; i--) { lser_put(&s, v->cell[i], LSER_PUT_VAL); }
+      break;
+    }
+  }
+
+  lstack_free(&s);
+}
+
+lval* builtin_save(lenv* e, lval* a) {
+  LASSERT_NUM("save", a, 2);
+  LASSERT_TYPE("save", a, 0, LVAL_STR);
+
+  lstrtab t = { NULL, NULL, 0, 0, NULL };
+  lval* err = lser_collect(e, &t, a->cell[1]);
+  if (err) { lstrtab_free(&t); lval_del(a); return err; }
+
+  FILE* f = fopen(a->cell[0]->str, "wb");
+  if (!f) {
+    lstrtab_free(&t);
+    LASSERT(a, false, "Could not open '%s': %s", a->cell[0]->str, strerror(errno));
+  }
+
+  lbuf b;
+  lbuf_init(&b, f);
+  lbuf_write(&b, LSER_MAGIC, 4);
+  lser_u32(&b, LSER_VERSION);
+  lser_u32(&b, t.count);
+  for (uint32_t i = 0; i < t.count; i++) {
+    uint32_t len = strlen(t.order[i]);
+    lser_u32(&b, len);
+    lbuf_write(&b, t.order[i], len);
+  }
+  lser_write(e, &t, &b, a->cell[1]);
+  lbuf_free(&b);
+  lstrtab_free(&t);
+
+  bool failed = ferror(f);
+  failed |= fclose(f) != 0;
+  LASSERT(a, !failed, "Could not write '%s'.", a->cell[0]->str);
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+typedef struct {
+  char* p;
+  char* end;
+  uint32_t count;
+  char** strs;
+  uint32_t* lens;
+} lser_reader;
+
+bool lser_get(lser_reader* r, void* out, size_t n) {
+  if ((size_t) (r->end - r->p) < n) { return false; }
+  memcpy(out, r->p, n);
+  r->p += n;
+  return true;
+}
+
+/* An atom, NULL when malformed */
+lval* lser_read_atom(lenv* e, lser_reader* r, uint8_t tag) {
+  uint32_t n;
+  uint64_t x;
+
+  switch (tag) {
+    case LSER_NUM:
+      if (!lser_get(r, &x, 8)) { return NULL; }
+      return lval_num((long) x);
+    case LSER_DEC: {
+      double d;
+      if (!lser_get(r, &d, 8)) { return NULL; }
+      return lval_dec(d);
+    }
+    case LSER_BOOL: {
+      uint8_t b;
+      if (!lser_get(r, &b, 1)) { return NULL; }
+      return lval_bln(b);
+    }
+    case LSER_SYM:
+    case LSER_STR:
+    case LSER_BUILTIN:
+      if (!lser_get(r, &n, 4) || n >= r->count) { return NULL; }
+      if (tag == LSER_STR) { return lval_strn(r->strs[n], r->lens[n]); }
+
+      char* name = malloc(r->lens[n] + 1);
+      memcpy(name, r->strs[n], r->lens[n]);
+      name[r->lens[n]] = '\0';
+      if (tag == LSER_SYM) {
+        lval* v = lval_alloc(LVAL_SYM);
+        v->sym = name;
+        lquota_heap(r->lens[n] + 1);
+        return v;
+      }
+
+      /* Builtins are looked up again by name */
+      lval* f = lenv_lookup(e, name);
+      free(name);
+      return f && f->type == LVAL_FUN && f->builtin ? lval_copy(f) : NULL;
+  }
+  return NULL;
+}
+
+/*
+ * Reads a tag. An atom or empty list comes back in out, anything else pushes
+ * a frame: the parts read so far, the tag and macro flag, and how many parts
+ * are left. False when malformed.
+ */
+bool lser_start(lenv* e, lser_reader* r, lstack* s, lval** out) {
+  uint8_t tag;
+  uint8_t macro = 0;
+  uint32_t n;
+  *out = NULL;
+  if (!lser_get(r, &tag, 1)) { return false; }
+
+  switch (tag) {
+    case LSER_SEXPR:
+    case LSER_QEXPR:
+      if (!lser_get(r, &n, 4)) { return false; }
+      if (n == 0) {
+        *out = tag == LSER_SEXPR ? lval_sexpr() : lval_qexpr();
+        return true;
+      }
+    break;
+    case LSER_LAMBDA:
+    case LSER_CLOSURE:
+      if (!lser_get(r, &macro, 1)) { return false; }
+      n = 2;
+    break;
+    case LSER_PARTIAL: n = 1; break;
+    default:
+      *out = lser_read_atom(e, r, tag);
+      return *out != NULL;
+  }
+
+  lstack_push(s, tag == LSER_QEXPR ? lval_qexpr() : lval_sexpr());
+  lstack_push2(s, (void*) (uintptr_t) (tag | macro << 8), (void*) (uintptr_t) n);
+  return true;
+}
+
+/* The list, lambda or partial application made of parts, NULL when malformed */
+lval* lser_finish(lenv* e, lval* parts, int tag, bool macro) {
+  if (tag == LSER_SEXPR || tag == LSER_QEXPR) { return parts; }
+
+  if (tag == LSER_PARTIAL) {
+    lval* f = lval_pop(parts, 0);
+    if (f->type != LVAL_FUN || f->builtin) { lval_del(f); lval_del(parts); return NULL; }
+    lval* v = lval_partial(f, parts);
+    lval_del(f);
+    return v;
+  }
+
+  /* Formals and body, then each captured symbol and its value */
+  bool ok = parts->cell[0]->type == LVAL_QEXPR && parts->cell[1]->type == LVAL_QEXPR;
+  for (int i = 2; ok && i < parts->count; i += 2) { ok = parts->cell[i]->type == LVAL_SYM; }
+  if (!ok) { lval_del(parts); return NULL; }
+
+  lval* formals = lval_pop(parts, 0);
+  lval* f = lval_lambda(formals, lval_pop(parts, 0));
+  if (tag == LSER_CLOSURE) {
+    f->caps = lenv_new();
+    while (parts->count) {
+      lval* k = lval_pop(parts, 0);
+      lenv_bind(f->caps, k, lval_pop(parts, 0));
+      lval_del(k);
+    }
+  }
+  lval_del(parts);
+
+  f->macro = macro;
+  lval_optimize(e, f);
+  if (macro) { lcur->macros++; }
+  return f;
+}
+
+/* NULL when the data is truncated or malformed */
+lval* lser_read(lenv* e, lser_reader* r) {
+  lstack s;
+  lstack_init(&s);
+
+  lval* x;
+  bool ok;
+  while ((ok = lser_start(e, r, &s, &x))) {
+    /* Give each finished value to the frame waiting on it, finishing those it completes */
+    while (x && s.count) {
+      void** top = &s.items[s.count - 3];
+      lval* parts = lval_add(top[0], x);
+      int tag = (uintptr_t) top[1] & 0xff;
+      uintptr_t left = (uintptr_t) top[2] - 1;
+      x = NULL;
+
+      /* How many captures or bound arguments there are follows the parts before them */
+      uint32_t n;
+      if ((tag == LSER_CLOSURE && parts->count == 2) || (tag == LSER_PARTIAL && parts->count == 1)) {
+        if (!lser_get(r, &n, 4)) { ok = false; break; }
+        left += tag == LSER_CLOSURE ? 2 * (uintptr_t) n : n;
+      }
+      top[2] = (void*) left;
+      if (left) { break; }
+
+      s.count -= 3;
+      x = lser_finish(e, parts, tag, (uintptr_t) top[1] >> 8);
+      if (!x) { ok = false; break; }
+    }
+    if (!ok || (x && !s.count)) { break; }
+  }
+
+  /* Frames still open were cut short */
+  while (s.count) {
+    s.count -= 2;
+    lval_del(lstack_pop(&s));
+  }
+  lstack_free(&s);
+  return ok ? x : NULL;
+}
+
+lval* builtin_restore(lenv* e, lval* a) {
+  LASSERT_NUM("restore", a, 1);
+  LASSERT_TYPE("restore", a, 0, LVAL_STR);
+
+  char* path = a->cell[0]->str;
+  int fd = open(path, O_RDONLY);
+  LASSERT(a, fd >= 0, "Could not open '%s': %s", path, strerror(errno));
+
+  struct stat st;
+  fstat(fd, &st);
+  size_t size = st.st_size;
+  char* data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  LASSERT(a, data != MAP_FAILED, "Could not map '%s'.", path);
+
+  lser_reader r = { data, data + size, 0, NULL, NULL };
+  uint32_t version;
+  lval* x = NULL;
+
+  if (size >= 4 && memcmp(data, LSER_MAGIC, 4) == 0) {
+    r.p += 4;
+    if (lser_get(&r, &version, 4) && version == LSER_VERSION && lser_get(&r, &r.count, 4)
+      && r.count <= size) {
+      r.strs = malloc(sizeof(char*) * (r.count + 1));
+      r.lens = malloc(sizeof(uint32_t) * (r.count + 1));
+      uint32_t i = 0;
+      for (; i < r.count; i++) {
+        if (!lser_get(&r, &r.lens[i], 4) || r.lens[i] > (size_t) (r.end - r.p)) { break; }
+        r.strs[i] = r.p;
+        r.p += r.lens[i];
+      }
+      if (i == r.count) { x = lser_read(e, &r); }
+      if (x && r.p != r.end) { lval_del(x); x = NULL; }
+      free(r.strs);
+      free(r.lens);
+    }
+  }
+  munmap(data, size);
+
+  LASSERT(a, x, "Could not restore '%s': not a valid version %i file.", path, LSER_VERSION);
+  lval_del(a);
+  return x;
+}
+
+#endif
+
+/* Heap Profiling */
+
+/*
+ * When profiling, every value and environment made gets a record in a list,
+ * tagged with the function being called at the time, its site. Sizes are
+ * only worked out for a snapshot, as lists and environments grow after
+ * they are allocated. Records outliving the context are detached from it.
+ */
+
+struct lheap_obj {
+  lheap_obj* prev;
+  lheap_obj* next;
+  lheap* heap;
+  void* p;
+  bool env;
+  uint32_t site;
+};
+
+struct lheap {
+  lheap_obj* objs;
+  lstrtab sites;
+};
+
+/* Values by type, then environments */
+#define LHEAP_TYPES (LVAL_TYPES + 1)
+
+enum { LHEAP_TOP, LHEAP_LAMBDA };
+
+uint32_t lheap_site(lheap* h, char* name) {
+  uint32_t i = lstrtab_intern(&h->sites, name, false);
+  if (i == UINT32_MAX) { i = lstrtab_intern(&h->sites, strdup(name), true); }
+  return i;
+}
+
+lheap* lheap_new(void) {
+  lheap* h = calloc(1, sizeof(lheap));
+  lheap_site(h, "<top>");
+  lheap_site(h, "<lambda>");
+  return h;
+}
+
+void lheap_free(lheap* h) {
+  for (lheap_obj* o = h->objs; o;) {
+    lheap_obj* next = o->next;
+    if (o->env) { ((lenv*) o->p)->prof = NULL; } else { ((lval*) o->p)->prof = NULL; }
+    free(o);
+    o = next;
+  }
+  for (uint32_t i = 0; i < h->sites.count; i++) { free(h->sites.order[i]); }
+  lstrtab_free(&h->sites);
+  free(h);
+}
+
+lheap_obj* lheap_track(void* p, bool env) {
+  lheap* h = lcur->heap;
+  lheap_obj* o = malloc(sizeof(lheap_obj));
+  o->prev = NULL;
+  o->next = h->objs;
+  o->heap = h;
+  o->p = p;
+  o->env = env;
+  o->site = lcur->site;
+  if (h->objs) { h->objs->prev = o; }
+  h->objs = o;
+  return o;
+}
+
+void lheap_untrack(lheap_obj* o) {
+  if (o->prev) { o->prev->next = o->next; } else { o->heap->objs = o->next; }
+  if (o->next) { o->next->prev = o->prev; }
+  free(o);
+}
+
+/* Tag what is made from now on with the function head calls, returning the old site */
+uint32_t lheap_enter(lval* head) {
+  uint32_t site = lcur->site;
+  lcur->site = head->type == LVAL_SYM ? lheap_site(lcur->heap, head->sym) : LHEAP_LAMBDA;
+  return site;
+}
+
+size_t lheap_size(lheap_obj* o) {
+  if (o->env) {
+    lenv* e = o->p;
+    size_t n = sizeof(lenv) + e->count * (sizeof(char*) + sizeof(lval*));
+    for (int i = 0; i < e->count; i++) { n += strlen(e->syms[i]) + 1; }
+    return n;
+  }
+
+  lval* v = o->p;
+  size_t n = sizeof(lval);
+  switch (v->type) {
+    case LVAL_ERR: n += sizeof(lerr); break;
+    case LVAL_SYM: n += strlen(v->sym) + 1; break;
+    case LVAL_STR: n += strlen(v->str) + 1; break;
+    case LVAL_FUN: if (!v->builtin && v->callee) { n += v->count * sizeof(lval*); } break;
+    case LVAL_QEXPR:
+    case LVAL_SEXPR: n += v->count * sizeof(lval*); break;
+  }
+  return n;
+}
+
+char* lheap_type_name(int t) {
+  return t == LVAL_TYPES ? "Environment" : ltype_name(t);
+}
+
+typedef struct {
+  char* type;
+  char* site;
+  long count;
+  long bytes;
+} lheap_entry;
+
+int lheap_entry_cmp(const void* a, const void* b) {
+  const lheap_entry* x = a;
+  const lheap_entry* y = b;
+  if (x->bytes != y->bytes) { return x->bytes > y->bytes ? -1 : 1; }
+  if (x->count != y->count) { return x->count > y->count ? -1 : 1; }
+  int c = strcmp(x->site, y->site);
+  return c ? c : strcmp(x->type, y->type);
+}
+
+/* Live objects grouped by type and site, largest first */
+lheap_entry* lheap_tally(lheap* h, size_t* count) {
+  size_t cells = (size_t) h->sites.count * LHEAP_TYPES;
+  lheap_entry* t = calloc(cells, sizeof(lheap_entry));
+  for (lheap_obj* o = h->objs; o; o = o->next) {
+    int type = o->env ? LVAL_TYPES : ((lval*) o->p)->type;
+    lheap_entry* x = &t[o->site * LHEAP_TYPES + type];
+    x->count++;
+    x->bytes += lheap_size(o);
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < cells; i++) {
+    if (!t[i].count) { continue; }
+    t[n] = t[i];
+    t[n].type = lheap_type_name(i % LHEAP_TYPES);
+    t[n].site = h->sites.order[i / LHEAP_TYPES];
+    n++;
+  }
+  qsort(t, n, sizeof(lheap_entry), lheap_entry_cmp);
+  *count = n;
+  return t;
+}
+
+lval* lheap_entry_list(lheap_entry* t, size_t n) {
+  lval* x = lval_qexpr();
+  for (size_t i = 0; i < n; i++) {
+    lval* y = lval_qexpr();
+    lval_add(y, lval_str(t[i].type));
+    lval_add(y, lval_str(t[i].site));
+    lval_add(y, lval_num(t[i].count));
+    lval_add(y, lval_num(t[i].bytes));
+    lval_add(x, y);
+  }
+  return x;
+}
+
+/* Whatever is still tracked once the context has torn everything down */
+void lheap_report(lheap* h, FILE* f) {
+  size_t n;
+  lheap_entry* t = lheap_tally(h, &n);
+  long count = 0, bytes = 0;
+  for (size_t i = 0; i < n; i++) { count += t[i].count; bytes += t[i].bytes; }
+
+  fprintf(f, "Heap profile: %li objects (%li bytes) not released at exit\n", count, bytes);
+  for (size_t i = 0; i < n; i++) {
+    fprintf(f, "  %-14s %-24s %8li %10li\n", t[i].type, t[i].site, t[i].count, t[i].bytes);
+  }
+  free(t);
+}
+
+lval* builtin_heap_snapshot(lenv* e, lval* a) {
+  lval_no_args(a);
+  LASSERT_CODE(a, a->count <= 1, LERR_ARITY,
+    "Function 'heap-snapshot' passed incorrect number of arguments. Got %i, Expected 0 or 1.",
+    a->count);
+  if (a->count == 1) { LASSERT_TYPE("heap-snapshot", a, 0, LVAL_STR); }
+  LASSERT(a, lcur->heap, "Heap profiling is off, start lithpy with --heap-profile.");
+
+  size_t n;
+  lheap_entry* t = lheap_tally(lcur->heap, &n);
+
+  /* Without a file, the entries themselves */
+  if (a->count == 0) {
+    lval* x = lheap_entry_list(t, n);
+    free(t);
+    lval_del(a);
+    return x;
+  }
+
+  FILE* f = fopen(a->cell[0]->str, "w");
+  if (!f) {
+    free(t);
+    LASSERT(a, false, "Could not open '%s': %s", a->cell[0]->str, strerror(errno));
+  }
+
+  long count = 0, bytes = 0;
+  fprintf(f, "# type\tsite\tcount\tbytes\n");
+  for (size_t i = 0; i < n; i++) {
+    fprintf(f, "%s\t%s\t%li\t%li\n", t[i].type, t[i].site, t[i].count, t[i].bytes);
+    count += t[i].count;
+    bytes += t[i].bytes;
+  }
+  free(t);
+
+  bool failed = ferror(f);
+  failed |= fclose(f) != 0;
+  LASSERT(a, !failed, "Could not write '%s'.", a->cell[0]->str);
+
+  lval_del(a);
+  return lval_add(lval_add(lval_qexpr(), lval_num(count)), lval_num(bytes));
+}
+
+/* Add a snapshot's entries to the table, negated for the earlier one */
+bool lheap_read(char* path, lstrtab* keys, lheap_entry** t, int sign) {
+  FILE* f = fopen(path, "r");
+  if (!f) { return false; }
+
+  char line[1024];
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), f)) {
+    if (line[0] == '#') { continue; }
+    char* tab = strchr(line, '\t');
+    char* end = tab ? strchr(tab + 1, '\t') : NULL;
+    long count, bytes;
+    if (!end || sscanf(end + 1, "%li\t%li", &count, &bytes) != 2) { ok = false; break; }
+
+    /* Keyed on the type and site together */
+    *end = '\0';
+    uint32_t i = lstrtab_intern(keys, line, false);
+    if (i == UINT32_MAX) {
+      i = lstrtab_intern(keys, strdup(line), true);
+      *t = realloc(*t, sizeof(lheap_entry) * keys->count);
+      (*t)[i].count = 0;
+      (*t)[i].bytes = 0;
+    }
+    (*t)[i].count += sign * count;
+    (*t)[i].bytes += sign * bytes;
+  }
+
+  fclose(f);
+  return ok;
+}
+
+lval* builtin_heap_diff(lenv* e, lval* a) {
+  LASSERT_NUM("heap-diff", a, 2);
+  LASSERT_TYPE("heap-diff", a, 0, LVAL_STR);
+  LASSERT_TYPE("heap-diff", a, 1, LVAL_STR);
+
+  lstrtab keys = { NULL, NULL, 0, 0, NULL };
+  lheap_entry* t = NULL;
+  char* bad = NULL;
+  if (!lheap_read(a->cell[0]->str, &keys, &t, -1)) { bad = a->cell[0]->str; }
+  else if (!lheap_read(a->cell[1]->str, &keys, &t, 1)) { bad = a->cell[1]->str; }
+
+  /* Only what changed, split back into type and site */
+  size_t n = 0;
+  for (uint32_t i = 0; !bad && i < keys.count; i++) {
+    if (!t[i].count && !t[i].bytes) { continue; }
+    char* tab = strchr(keys.order[i], '\t');
+    *tab = '\0';
+    t[n].type = keys.order[i];
+    t[n].site = tab + 1;
+    t[n].count = t[i].count;
+    t[n].bytes = t[i].bytes;
+    n++;
+  }
+  if (n) { qsort(t, n, sizeof(lheap_entry), lheap_entry_cmp); }
+  lval* x = bad ? NULL : lheap_entry_list(t, n);
+
+  for (uint32_t i = 0; i < keys.count; i++) { free(keys.order[i]); }
+  lstrtab_free(&keys);
+  free(t);
+  LASSERT(a, x, "Could not read heap snapshot '%s'.", bad);
+
+  lval_del(a);
+  return x;
+}
+
+/* Regular Expressions */
+
+#ifndef _WIN32
+
+/*
+ * POSIX extended regular expressions, matched in place on the string's own
+ * buffer. Compiled patterns are kept in a small per-context cache, evicting
+ * the least recently used, so patterns in loops are compiled once.
+ */
+
+#define LRE_CACHE 32
+#define LRE_GROUPS 10
+
+typedef struct {
+  char* pattern;
+  uint32_t hash;
+  regex_t re;
+  long used;
+} lre_entry;
+
+struct lre {
+  lre_entry entries[LRE_CACHE];
+  int count;
+  long clock;
+};
+
+/* Compiled pattern, or NULL with the reason written to err */
+regex_t* lre_get(char* pattern, char* err, size_t n) {
+  if (!lcur->re) { lcur->re = calloc(1, sizeof(lre)); }
+  lre* c = lcur->re;
+  uint32_t hash = lstrtab_hash(pattern);
+
+  for (int i = 0; i < c->count; i++) {
+    lre_entry* x = &c->entries[i];
+    if (x->hash == hash && strcmp(x->pattern, pattern) == 0) {
+      x->used = ++c->clock;
+      return &x->re;
+    }
+  }
+
+  regex_t re;
+  int code = regcomp(&re, pattern, REG_EXTENDED);
+  if (code != 0) {
+    regerror(code, &re, err, n);
+    return NULL;
+  }
+
+  lre_entry* x = &c->entries[0];
+  if (c->count < LRE_CACHE) {
+    x = &c->entries[c->count++];
+  } else {
+    for (int i = 1; i < LRE_CACHE; i++) {
+      if (c->entries[i].used < x->used) { x = &c->entries[i]; }
+    }
+    free(x->pattern);
+    regfree(&x->re);
+  }
+
+  x->pattern = strdup(pattern);
+  x->hash = hash;
+  x->re = re;
+  x->used = ++c->clock;
+  return &x->re;
+}
+
+void lre_free(void) {
+  lre* c = lcur->re;
+  if (!c) { return; }
+  for (int i = 0; i < c->count; i++) {
+    free(c->entries[i].pattern);
+    regfree(&c->entries[i].re);
+  }
+  free(c);
+  lcur->re = NULL;
+}
+
+/* Next match at or after offset, with group offsets relative to the string */
+bool lre_exec(regex_t* re, char* s, size_t off, regmatch_t* m) {
+  if (regexec(re, s + off, LRE_GROUPS, m, off ? REG_NOTBOL : 0) != 0) { return false; }
+  for (int i = 0; i < LRE_GROUPS; i++) {
+    if (m[i].rm_so >= 0) { m[i].rm_so += off; m[i].rm_eo += off; }
+  }
+  return true;
+}
+
+/* Where to search after a match, stepping past empty matches */
+size_t lre_next(regmatch_t* m) {
+  return m[0].rm_eo + (m[0].rm_eo == m[0].rm_so);
+}
+
+#define LRE_ARGS(func, args, num) \
+  LASSERT_NUM(func, args, num); \
+  for (int i = 0; i < num; i++) { LASSERT_TYPE(func, args, i, LVAL_STR); } \
+  char reason[128]; \
+  regex_t* re = lre_get(args->cell[0]->str, reason, sizeof(reason)); \
+  LASSERT(args, re, "Function '%s' passed invalid pattern '%s': %s", \
+    func, args->cell[0]->str, reason); \
+  char* s = args->cell[1]->str; \
+  regmatch_t m[LRE_GROUPS];
+
+/* The first match followed by its groups, or {} if there is none */
+lval* builtin_re_match(lenv* e, lval* a) {
+  LRE_ARGS("re-match", a, 2);
+
+  lval* x = lval_qexpr();
+  if (lre_exec(re, s, 0, m)) {
+    for (size_t i = 0; i <= re->re_nsub && i < LRE_GROUPS; i++) {
+      if (m[i].rm_so < 0) { lval_add(x, lval_str("")); continue; }
+      lval_add(x, lval_strn(s + m[i].rm_so, m[i].rm_eo - m[i].rm_so));
+    }
+  }
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_re_find_all(lenv* e, lval* a) {
+  LRE_ARGS("re-find-all", a, 2);
+
+  lval* x = lval_qexpr();
+  size_t off = 0;
+  while (lre_exec(re, s, off, m)) {
+    lval_add(x, lval_strn(s + m[0].rm_so, m[0].rm_eo - m[0].rm_so));
+    if (!s[m[0].rm_eo]) { break; }
+    off = lre_next(m);
+  }
+  lval_del(a);
+  return x;
+}
+
+/* Replaces every match, with \0 to \9 in the replacement standing for groups */
+lval* builtin_re_replace(lenv* e, lval* a) {
+  LRE_ARGS("re-replace", a, 3);
+  char* with = a->cell[2]->str;
+
+  lbuf b;
+  lbuf_init(&b, NULL);
+  size_t off = 0;
+  size_t done = 0;
+  while (lre_exec(re, s, off, m)) {
+    lbuf_write(&b, s + done, m[0].rm_so - done);
+    for (char* r = with; *r; r++) {
+      if (r[0] == '\\' && r[1] >= '0' && r[1] <= '9') {
+        regmatch_t g = m[r[1] - '0'];
+        if (g.rm_so >= 0) { lbuf_write(&b, s + g.rm_so, g.rm_eo - g.rm_so); }
+        r++;
+      } else {
+        lbuf_putc(&b, *r);
+      }
+    }
+    done = m[0].rm_eo;
+    if (!s[done]) { break; }
+    off = lre_next(m);
+  }
+  lbuf_write(&b, s + done, strlen(s + done));
+
+  lval* x = lval_strn(b.data, b.len);
+  lbuf_free(&b);
+  lval_del(a);
+  return x;
+}
+
+/* Pieces of the string between matches */
+lval* builtin_re_split(lenv* e, lval* a) {
+  LRE_ARGS("re-split", a, 2);
+
+  lval* x = lval_qexpr();
+  size_t off = 0;
+  size_t start = 0;
+  while (s[off] && lre_exec(re, s, off, m)) {
+    /* An empty match at the start of a piece doesn't split it */
+    if (m[0].rm_eo == m[0].rm_so && (size_t) m[0].rm_so == start) {
+      off = lre_next(m);
+      continue;
+    }
+    lval_add(x, lval_strn(s + start, m[0].rm_so - start));
+    start = m[0].rm_eo;
+    off = lre_next(m);
+  }
+  lval_add(x, lval_str(s + start));
+  lval_del(a);
+  return x;
+}
+
+#else
+
+void lre_free(void) {}
+
+#endif
+
+/* Optimization */
+
+/*
+ * Lambda bodies are rewritten once when defined: constant arithmetic is
+ * folded, 'if' with a constant condition is replaced by the taken branch,
+ * and calls to small non-recursive global lambdas are inlined. Names the
+ * body binds itself are treated as locals and never resolved to globals.
+ * Rebinding a global function bumps the context's epoch, and stale bodies
+ * are rewritten again on their next call.
+ */
+
+#define LOPT_INLINE_SIZE 24
+#define LOPT_MAX_DEPTH 4
+
+/* Builtins without side effects, safe to run on constant arguments */
+lbuiltin lopt_pure[] = {
+  builtin_add, builtin_sub, builtin_mul, builtin_div,
+  builtin_min, builtin_max, builtin_rem, builtin_pow,
+  builtin_gt, builtin_lt, builtin_ge, builtin_le,
+  builtin_eq, builtin_ne, builtin_or, builtin_and, builtin_not,
+  NULL
+};
+
+/* Builtins acting on their environment, which inlining would change */
+lbuiltin lopt_scoped[] = {
+  builtin_lambda, builtin_def, builtin_put, builtin_fun, builtin_defmacro,
+  builtin_locals, builtin_load, builtin_exit,
+  NULL
+};
+
+/* Builtins binding the names in their first argument */
+lbuiltin lopt_binding[] = {
+  builtin_lambda, builtin_def, builtin_put, builtin_fun, builtin_defmacro,
+  NULL
+};
+
+bool lopt_member(lbuiltin* set, lbuiltin f) {
+  for (int i = 0; set[i]; i++) {
+    if (set[i] == f) { return true; }
+  }
+  return false;
+}
+
+bool lval_literal(lval* v) {
+  return v->type == LVAL_NUM || v->type == LVAL_DEC
+      || v->type == LVAL_STR || v->type == LVAL_BOOL;
+}
+
+int lval_size(lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return 1; }
+  int n = 1;
+  for (int i = 0; i < v->count; i++) { n += lval_size(v->cell[i]); }
+  return n;
+}
+
+/* Count uses of sym, noting if any are inside a Q-Expression, or in the
+ * second operand of '&&' and '||' which might never be evaluated either */
+int lval_uses(lval* v, char* sym, bool quoted, bool* in_quote) {
+  if (v->type == LVAL_SYM && strcmp(v->sym, sym) == 0) {
+    if (quoted) { *in_quote = true; }
+    return 1;
+  }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return 0; }
+  bool lazy = v->type == LVAL_SEXPR && v->count > 0 && v->cell[0]->type == LVAL_SYM
+    && (strcmp(v->cell[0]->sym, "&&") == 0 || strcmp(v->cell[0]->sym, "||") == 0);
+  int n = 0;
+  for (int i = 0; i < v->count; i++) {
+    bool q = quoted || v->type == LVAL_QEXPR || (lazy && i > 1);
+    n += lval_uses(v->cell[i], sym, q, in_quote);
+  }
+  return n;
+}
+
+bool lval_has_sym(lval* v, char* sym) {
+  bool quoted = false;
+  return lval_uses(v, sym, false, &quoted) > 0;
+}
+
+/* Copy of v with each formal replaced by the matching argument */
+lval* lopt_subst(lval* v, lval* formals, lval** args) {
+  if (v->type == LVAL_SYM) {
+    for (int i = 0; i < formals->count; i++) {
+      if (strcmp(v->sym, formals->cell[i]->sym) == 0) { return lval_copy(args[i]); }
+    }
+  }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return lval_copy(v); }
+  lval* x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+  for (int i = 0; i < v->count; i++) {
+    lval_add(x, lopt_subst(v->cell[i], formals, args));
+  }
+  return x;
+}
+
+/* Every free symbol in body must be a global that doesn't act on scope */
+bool lopt_inlinable(lenv* e, lval* v, lval* formals, lval* outer) {
+  if (v->type == LVAL_SYM) {
+    if (lval_has_sym(formals, v->sym)) { return true; }
+    if (lval_has_sym(outer, v->sym)) { return false; }
+    lval* x = lenv_lookup(e, v->sym);
+    if (!x) { return false; }
+    return !(x->type == LVAL_FUN && x->builtin && lopt_member(lopt_scoped, x->builtin));
+  }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return true; }
+  for (int i = 0; i < v->count; i++) {
+    if (!lopt_inlinable(e, v->cell[i], formals, outer)) { return false; }
+  }
+  return true;
+}
+
+/* Add every name v could bind to locals, false if one is computed at run time */
+bool lopt_bound(lenv* e, lval* v, lval* locals) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return true; }
+
+  lval* f = v->count > 0 && v->cell[0]->type == LVAL_SYM
+    ? lenv_lookup(e, v->cell[0]->sym) : NULL;
+  if (f && f->type == LVAL_FUN && f->builtin && lopt_member(lopt_binding, f->builtin)) {
+    if (v->count < 2 || v->cell[1]->type != LVAL_QEXPR) { return false; }
+    lval* names = v->cell[1];
+    for (int i = 0; i < names->count; i++) {
+      if (names->cell[i]->type != LVAL_SYM) { return false; }
+      lval_add(locals, lval_copy(names->cell[i]));
+    }
+  }
+
+  for (int i = 0; i < v->count; i++) {
+    if (!lopt_bound(e, v->cell[i], locals)) { return false; }
+  }
+  return true;
+}
+
+lval* lopt_expr(lenv* e, lval* formals, lval* x, int depth);
+
+/* A single expression in S-Expression position evaluates the same alone */
+lval* lopt_unwrap(lval* x) {
+  if (x->type == LVAL_SEXPR && x->count == 1 && lval_literal(x->cell[0])) {
+    return lval_take(x, 0);
+  }
+  return x;
+}
+
+/* Optimize a Q-Expression that will be evaluated as code */
+lval* lopt_block(lenv* e, lval* formals, lval* q, int depth) {
+  lval* x = lval_copy(q);
+  x->type = LVAL_SEXPR;
+  lval* y = lopt_expr(e, formals, x, depth);
+  lval_del(x);
+  if (y->type == LVAL_SEXPR) {
+    y->type = LVAL_QEXPR;
+    return y;
+  }
+  return lval_add(lval_qexpr(), y);
+}
+
+lval* lopt_if(lenv* e, lval* formals, lval* y, int depth) {
+  if (y->count != 4
+    || y->cell[2]->type != LVAL_QEXPR
+    || y->cell[3]->type != LVAL_QEXPR) { return y; }
+
+  for (int i = 2; i < 4; i++) {
+    lval* b = lopt_block(e, formals, y->cell[i], depth);
+    lval_del(y->cell[i]);
+    y->cell[i] = b;
+  }
+
+  lval* c = y->cell[1];
+  if (c->type != LVAL_NUM && c->type != LVAL_BOOL) { return y; }
+
+  lval* x = lval_pop(y, lval_truthy(c) ? 2 : 3);
+  lval_del(y);
+  x->type = LVAL_SEXPR;
+  return lopt_unwrap(x);
+}
+
+lval* lopt_fold(lenv* e, lval* f, lval* y) {
+  if (y->count < 2) { return y; }
+  for (int i = 1; i < y->count; i++) {
+    if (!lval_literal(y->cell[i])) { return y; }
+  }
+
+  lval* args = lval_sexpr();
+  for (int i = 1; i < y->count; i++) { lval_add(args, lval_copy(y->cell[i])); }
+
+  /* Errors are left to happen at run time */
+  lval* x = f->builtin(e, args);
+  if (x->type == LVAL_ERR) { lval_del(x); return y; }
+  lval_del(y);
+  return x;
+}
+
+lval* lopt_inline(lenv* e, lval* formals, lval* f, lval* y, int depth) {
+  lval* params = f->formals;
+  lval* body = f->opt ? f->opt : f->body;
+  char* name = y->cell[0]->sym;
+
+  if (y->count - 1 != params->count) { return y; }
+  if (lval_has_sym(params, "&")) { return y; }
+  if (lval_size(body) > LOPT_INLINE_SIZE) { return y; }
+  if (lval_has_sym(body, name)) { return y; }
+  if (!lopt_inlinable(e, body, params, formals)) { return y; }
+
+  /* Arguments with effects must be evaluated exactly once, in place */
+  for (int i = 0; i < params->count; i++) {
+    lval* arg = y->cell[i+1];
+    if (lval_literal(arg) || arg->type == LVAL_SYM) { continue; }
+    bool quoted = false;
+    int uses = 0;
+    for (int j = 0; j < body->count; j++) {
+      uses += lval_uses(body->cell[j], params->cell[i]->sym, false, &quoted);
+    }
+    if (uses != 1 || quoted) { return y; }
+  }
+
+  lval* x = lopt_subst(body, params, y->cell + 1);
+  x->type = LVAL_SEXPR;
+  lval* r = lopt_expr(e, formals, x, depth + 1);
+  lval_del(x);
+  lval_del(y);
+  return lopt_unwrap(r);
+}
+
+lval* lopt_expr(lenv* e, lval* formals, lval* x, int depth) {
+  if (x->type != LVAL_SEXPR) { return lval_copy(x); }
+
+  lval* y = lval_sexpr();
+  for (int i = 0; i < x->count; i++) {
+    lval_add(y, lopt_expr(e, formals, x->cell[i], depth));
+  }
+
+  if (y->count == 0 || y->cell[0]->type != LVAL_SYM) { return y; }
+  if (lval_has_sym(formals, y->cell[0]->sym)) { return y; }
+
+  lval* f = lenv_lookup(e, y->cell[0]->sym);
+  if (!f || f->type != LVAL_FUN) { return y; }
+
+  if (f->builtin == builtin_if) { return lopt_if(e, formals, y, depth); }
+  if (f->builtin && lopt_member(lopt_pure, f->builtin)) { return lopt_fold(e, f, y); }
+  if (!f->builtin && !f->callee && !f->caps && !f->scope && !f->macro && depth < LOPT_MAX_DEPTH) {
+    return lopt_inline(e, formals, f, y, depth);
+  }
+  return y;
+}
+
+void lval_optimize(lenv* e, lval* f) {
+  /* Captured variables and names bound in the body are locals too */
+  lval* locals = lval_copy(f->formals);
+  if (f->caps) {
+    for (int i = 0; i < f->caps->count; i++) { lval_add(locals, lval_sym(f->caps->syms[i])); }
+  }
+
+  /* Without knowing every local, no global can safely be resolved */
+  lval* x = lopt_bound(lenv_top(e), f->body, locals)
+    ? lopt_block(lenv_top(e), locals, f->body, 0) : lval_copy(f->body);
+  lval_del(locals);
+  x->refs = 0;
+  if (f->opt && f->opt->refs == 0) { lval_del(f->opt); }
+  f->opt = x;
+  f->epoch = lcur->epoch;
+
+  /* Native code was compiled from the old body */
+  ljit_free(f);
+  f->jit_epoch = -1;
+}
+
+lval* builtin_optimized_body(lenv* e, lval* a) {
+  LASSERT_NUM("optimized-body", a, 1);
+  LASSERT_TYPE("optimized-body", a, 0, LVAL_FUN);
+  LASSERT(a, !a->cell[0]->builtin && !a->cell[0]->callee,
+    "Function 'optimized-body' passed builtin or partial application.");
+
+  lval* f = a->cell[0];
+  if (f->epoch != lcur->epoch) { lval_optimize(e, f); }
+  lval* x = lval_copy(f->opt);
+  lval_del(a);
+  return x;
+}
+
+/* Native Compilation */
+
+/*
+ * Lambdas whose optimized body only uses integer arithmetic, comparisons,
+ * 'if' and calls to themselves are compiled to x86-64 on their first call.
+ * Calls with anything but Numbers as arguments and division by zero bail
+ * out, and the call is redone by the interpreter. Running short of stack
+ * stops the evaluation as the interpreter would. Code is compiled for one
+ * optimizer epoch and dropped with the optimized body.
+ */
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#define LJIT_MAX_ARGS 16
+
+enum { LJIT_FAIL, LJIT_INT, LJIT_BOOL };
+
+struct ljit {
+  unsigned char* code;
+  size_t size;
+  int type;
+};
+
+/* Set in the bail flag, with the stack bit when the stack ran short */
+#define LJIT_BAIL 1
+#define LJIT_BAIL_STACK 2
+
+/* Shared with native code: bail flag at offset 0, stack limit at offset 8 */
+typedef struct {
+  long bail;
+  uintptr_t limit;
+} ljit_ctx;
+
+typedef long(*ljit_fn)(long*, ljit_ctx*);
+
+typedef struct {
+  lenv* e;
+  lval* f;
+  int self_type;
+  bool self_called;
+  unsigned char* code;
+  size_t len;
+  size_t cap;
+  size_t* bails;
+  int nbails;
+} ljit_asm;
+
+void ljit_bytes(ljit_asm* j, const char* b, size_t n) {
+  if (j->len + n > j->cap) {
+    while (j->len + n > j->cap) { j->cap *= 2; }
+    j->code = realloc(j->code, j->cap);
+  }
+  memcpy(j->code + j->len, b, n);
+  j->len += n;
+}
+
+#define LJIT_EMIT(j, ...) do { \
+  const char b[] = { __VA_ARGS__ }; ljit_bytes(j, b, sizeof(b)); \
+} while (0)
+
+void ljit_u32(ljit_asm* j, unsigned int x) { ljit_bytes(j, (char*) &x, 4); }
+void ljit_u64(ljit_asm* j, unsigned long x) { ljit_bytes(j, (char*) &x, 8); }
+
+/* Emit a rel32 jump opcode, returning the offset of its operand */
+size_t ljit_jump(ljit_asm* j, const char* op, size_t n) {
+  ljit_bytes(j, op, n);
+  ljit_u32(j, 0);
+  return j->len - 4;
+}
+
+void ljit_patch(ljit_asm* j, size_t at, size_t target) {
+  unsigned int rel = (unsigned int) (target - (at + 4));
+  memcpy(j->code + at, &rel, 4);
+}
+
+void ljit_bail_if(ljit_asm* j, const char* op, size_t n) {
+  j->bails = realloc(j->bails, sizeof(size_t) * (j->nbails + 1));
+  j->bails[j->nbails++] = ljit_jump(j, op, n);
+}
+
+#define LJIT_JZ  "\x0F\x84", 2
+#define LJIT_JNE "\x0F\x85", 2
+#define LJIT_JB  "\x0F\x82", 2
+#define LJIT_JMP "\xE9", 1
+
+int ljit_expr(ljit_asm* j, lval* x);
+
+/* Compile a Q-Expression that will be evaluated as an S-Expression */
+int ljit_block(ljit_asm* j, lval* q) {
+  if (q->type != LVAL_QEXPR || q->count == 0) { return LJIT_FAIL; }
+  if (q->count == 1) { return ljit_expr(j, q->cell[0]); }
+  q->type = LVAL_SEXPR;
+  int t = ljit_expr(j, q);
+  q->type = LVAL_QEXPR;
+  return t;
+}
+
+/* Leaves the first operand in rax and the second in rcx */
+bool ljit_pair(ljit_asm* j, lval* a, lval* b, int type) {
+  if (ljit_expr(j, a) != type) { return false; }
+  LJIT_EMIT(j, 0x50);                          /* push rax */
+  if (ljit_expr(j, b) != type) { return false; }
+  LJIT_EMIT(j, 0x48, 0x89, 0xC1);              /* mov rcx, rax */
+  LJIT_EMIT(j, 0x58);                          /* pop rax */
+  return true;
+}
+
+int ljit_arith(ljit_asm* j, lbuiltin op, lval* y) {
+  if (y->count < 2) { return LJIT_FAIL; }
+  if (ljit_expr(j, y->cell[1]) != LJIT_INT) { return LJIT_FAIL; }
+
+  if (y->count == 2) {
+    if (op == builtin_sub) { LJIT_EMIT(j, 0x48, 0xF7, 0xD8); }   /* neg rax */
+    return LJIT_INT;
+  }
+
+  for (int i = 2; i < y->count; i++) {
+    LJIT_EMIT(j, 0x50);                        /* push rax */
+    if (ljit_expr(j, y->cell[i]) != LJIT_INT) { return LJIT_FAIL; }
+    LJIT_EMIT(j, 0x48, 0x89, 0xC1);            /* mov rcx, rax */
+    LJIT_EMIT(j, 0x58);                        /* pop rax */
+
+    if (op == builtin_add) { LJIT_EMIT(j, 0x48, 0x01, 0xC8); }        /* add rax, rcx */
+    if (op == builtin_sub) { LJIT_EMIT(j, 0x48, 0x29, 0xC8); }        /* sub rax, rcx */
+    if (op == builtin_mul) { LJIT_EMIT(j, 0x48, 0x0F, 0xAF, 0xC1); }  /* imul rax, rcx */
+    if (op == builtin_div || op == builtin_rem) {
+      LJIT_EMIT(j, 0x48, 0x85, 0xC9);          /* test rcx, rcx */
+      ljit_bail_if(j, LJIT_JZ);
+      LJIT_EMIT(j, 0x48, 0x83, 0xF9, 0xFF);    /* cmp rcx, -1 */
+      size_t general = ljit_jump(j, LJIT_JNE);
+      if (op == builtin_div) {
+        LJIT_EMIT(j, 0x48, 0xF7, 0xD8);        /* neg rax */
+      } else {
+        LJIT_EMIT(j, 0x31, 0xC0);              /* xor eax, eax */
+      }
+      size_t done = ljit_jump(j, LJIT_JMP);
+      ljit_patch(j, general, j->len);
+      LJIT_EMIT(j, 0x48, 0x99);                /* cqo */
+      LJIT_EMIT(j, 0x48, 0xF7, 0xF9);          /* idiv rcx */
+      if (op == builtin_rem) {
+        LJIT_EMIT(j, 0x48, 0x89, 0xD0);        /* mov rax, rdx */
+      }
+      ljit_patch(j, done, j->len);
+    }
+  }
+  return LJIT_INT;
+}
+
+int ljit_compare(ljit_asm* j, lbuiltin op, lval* y) {
+  if (y->count != 3) { return LJIT_FAIL; }
+
+  int type = LJIT_INT;
+  if (op == builtin_eq || op == builtin_ne) {
+    /* Both sides must agree in type, probe the first one */
+    size_t len = j->len;
+    int nbails = j->nbails;
+    type = ljit_expr(j, y->cell[1]);
+    j->len = len;
+    j->nbails = nbails;
+    if (type == LJIT_FAIL) { return LJIT_FAIL; }
+  }
+  if (!ljit_pair(j, y->cell[1], y->cell[2], type)) { return LJIT_FAIL; }
+
+  char cc = 0;
+  if (op == builtin_gt) { cc = 0x9F; }
+  if (op == builtin_lt) { cc = 0x9C; }
+  if (op == builtin_ge) { cc = 0x9D; }
+  if (op == builtin_le) { cc = 0x9E; }
+  if (op == builtin_eq) { cc = 0x94; }
+  if (op == builtin_ne) { cc = 0x95; }
+
+  LJIT_EMIT(j, 0x48, 0x39, 0xC8);              /* cmp rax, rcx */
+  LJIT_EMIT(j, 0x0F, cc, 0xC0);                /* setcc al */
+  LJIT_EMIT(j, 0x0F, 0xB6, 0xC0);              /* movzx eax, al */
+  return LJIT_BOOL;
+}
+
+int ljit_logic(ljit_asm* j, lbuiltin op, lval* y) {
+  if (op == builtin_not) {
+    if (y->count != 2 || ljit_expr(j, y->cell[1]) != LJIT_INT) { return LJIT_FAIL; }
+    LJIT_EMIT(j, 0x48, 0x85, 0xC0);            /* test rax, rax */
+    LJIT_EMIT(j, 0x0F, 0x94, 0xC0);            /* sete al */
+    LJIT_EMIT(j, 0x0F, 0xB6, 0xC0);            /* movzx eax, al */
+    return LJIT_INT;
+  }
+
+  /* Short circuits like the interpreter, so both operands must agree in type */
+  if (y->count != 3) { return LJIT_FAIL; }
+  int type = ljit_expr(j, y->cell[1]);
+  if (type == LJIT_FAIL) { return LJIT_FAIL; }
+  LJIT_EMIT(j, 0x48, 0x85, 0xC0);              /* test rax, rax */
+  LJIT_EMIT(j, 0x0F, 0x95, 0xC0);              /* setne al */
+  LJIT_EMIT(j, 0x0F, 0xB6, 0xC0);              /* movzx eax, al */
+  size_t done = op == builtin_and ? ljit_jump(j, LJIT_JZ) : ljit_jump(j, LJIT_JNE);
+  if (ljit_expr(j, y->cell[2]) != type) { return LJIT_FAIL; }
+  LJIT_EMIT(j, 0x48, 0x85, 0xC0);              /* test rax, rax */
+  LJIT_EMIT(j, 0x0F, 0x95, 0xC0);              /* setne al */
+  LJIT_EMIT(j, 0x0F, 0xB6, 0xC0);              /* movzx eax, al */
+  ljit_patch(j, done, j->len);
+  return type;
+}
+
+int ljit_if(ljit_asm* j, lval* y) {
+  if (y->count != 4) { return LJIT_FAIL; }
+  if (ljit_expr(j, y->cell[1]) == LJIT_FAIL) { return LJIT_FAIL; }
+
+  LJIT_EMIT(j, 0x48, 0x85, 0xC0);              /* test rax, rax */
+  size_t other = ljit_jump(j, LJIT_JZ);
+  int t = ljit_block(j, y->cell[2]);
+  size_t done = ljit_jump(j, LJIT_JMP);
+  ljit_patch(j, other, j->len);
+  int u = ljit_block(j, y->cell[3]);
+  ljit_patch(j, done, j->len);
+
+  return t == u ? t : LJIT_FAIL;
+}
+
+int ljit_self(ljit_asm* j, lval* y) {
+  int n = y->count - 1;
+  if (n != j->f->formals->count) { return LJIT_FAIL; }
+
+  /* Arguments are pushed last first, leaving an array on the stack */
+  for (int i = n - 1; i >= 0; i--) {
+    if (ljit_expr(j, y->cell[i+1]) != LJIT_INT) { return LJIT_FAIL; }
+    LJIT_EMIT(j, 0x50);                        /* push rax */
+  }
+  LJIT_EMIT(j, 0x48, 0x89, 0xE7);              /* mov rdi, rsp */
+  LJIT_EMIT(j, 0x4C, 0x89, 0xE6);              /* mov rsi, r12 */
+  LJIT_EMIT(j, 0xE8);                          /* call entry */
+  ljit_u32(j, (unsigned int) (0 - (j->len + 4)));
+  LJIT_EMIT(j, 0x48, 0x81, 0xC4);              /* add rsp, 8n */
+  ljit_u32(j, 8 * n);
+  LJIT_EMIT(j, 0x49, 0x83, 0x3C, 0x24, 0x00);  /* cmp qword [r12], 0 */
+  ljit_bail_if(j, LJIT_JNE);
+
+  j->self_called = true;
+  return j->self_type;
+}
+
+int ljit_expr(ljit_asm* j, lval* x) {
+  if (x->type == LVAL_NUM) {
+    LJIT_EMIT(j, 0x48, 0xB8);                  /* mov rax, imm64 */
+    ljit_u64(j, (unsigned long) x->num);
+    return LJIT_INT;
+  }
+
+  if (x->type == LVAL_SYM) {
+    lval* formals = j->f->formals;
+    for (int i = 0; i < formals->count; i++) {
+      if (strcmp(formals->cell[i]->sym, x->sym) == 0) {
+        LJIT_EMIT(j, 0x48, 0x8B, 0x83);        /* mov rax, [rbx + 8i] */
+        ljit_u32(j, 8 * i);
+        return LJIT_INT;
+      }
+    }
+    return LJIT_FAIL;
+  }
+
+  if (x->type != LVAL_SEXPR || x->count == 0) { return LJIT_FAIL; }
+  if (x->count == 1) { return ljit_expr(j, x->cell[0]); }
+
+  lval* head = x->cell[0];
+  if (head->type != LVAL_SYM) { return LJIT_FAIL; }
+  if (lval_has_sym(j->f->formals, head->sym)) { return LJIT_FAIL; }
+
+  lval* f = lenv_lookup(j->e, head->sym);
+  if (!f || f->type != LVAL_FUN) { return LJIT_FAIL; }
+  if (f == j->f) { return ljit_self(j, x); }
+
+  lbuiltin op = f->builtin;
+  if (op == builtin_add || op == builtin_sub || op == builtin_mul
+    || op == builtin_div || op == builtin_rem) { return ljit_arith(j, op, x); }
+  if (op == builtin_gt || op == builtin_lt || op == builtin_ge
+    || op == builtin_le || op == builtin_eq || op == builtin_ne) { return ljit_compare(j, op, x); }
+  if (op == builtin_and || op == builtin_or || op == builtin_not) { return ljit_logic(j, op, x); }
+  if (op == builtin_if) { return ljit_if(j, x); }
+  return LJIT_FAIL;
+}
+
+/* Compile the body assuming self calls return type, NULL on failure */
+ljit* ljit_assemble(lenv* e, lval* f, int type) {
+  ljit_asm j = { e, f, type, false, malloc(256), 0, 256, NULL, 0 };
+
+  LJIT_EMIT(&j, 0x55);                         /* push rbp */
+  LJIT_EMIT(&j, 0x48, 0x89, 0xE5);             /* mov rbp, rsp */
+  LJIT_EMIT(&j, 0x53);                         /* push rbx */
+  LJIT_EMIT(&j, 0x41, 0x54);                   /* push r12 */
+  LJIT_EMIT(&j, 0x48, 0x89, 0xFB);             /* mov rbx, rdi */
+  LJIT_EMIT(&j, 0x49, 0x89, 0xF4);             /* mov r12, rsi */
+  LJIT_EMIT(&j, 0x49, 0x3B, 0x64, 0x24, 0x08); /* cmp rsp, [r12 + 8] */
+  size_t low = ljit_jump(&j, LJIT_JB);
+
+  int t = ljit_block(&j, f->opt);
+  ljit* jit = NULL;
+
+  if (t != LJIT_FAIL && (!j.self_called || t == type)) {
+    LJIT_EMIT(&j, 0x41, 0x5C);                 /* pop r12 */
+    LJIT_EMIT(&j, 0x5B);                       /* pop rbx */
+    LJIT_EMIT(&j, 0x5D);                       /* pop rbp */
+    LJIT_EMIT(&j, 0xC3);                       /* ret */
+
+    ljit_patch(&j, low, j.len);
+    LJIT_EMIT(&j, 0x49, 0xC7, 0x04, 0x24, LJIT_BAIL_STACK, 0x00, 0x00, 0x00); /* mov qword [r12], 2 */
+    for (int i = 0; i < j.nbails; i++) { ljit_patch(&j, j.bails[i], j.len); }
+    LJIT_EMIT(&j, 0x49, 0x83, 0x0C, 0x24, LJIT_BAIL); /* or qword [r12], 1 */
+    LJIT_EMIT(&j, 0x48, 0x8D, 0x65, 0xF0);     /* lea rsp, [rbp - 16] */
+    LJIT_EMIT(&j, 0x41, 0x5C);                 /* pop r12 */
+    LJIT_EMIT(&j, 0x5B);                       /* pop rbx */
+    LJIT_EMIT(&j, 0x5D);                       /* pop rbp */
+    LJIT_EMIT(&j, 0xC3);                       /* ret */
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (j.len + page - 1) / page * page;
+    void* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+      memcpy(code, j.code, j.len);
+      if (mprotect(code, size, PROT_READ | PROT_EXEC) == 0) {
+        jit = malloc(sizeof(ljit));
+        jit->code = code;
+        jit->size = size;
+        jit->type = t;
+      } else {
+        munmap(code, size);
+      }
+    }
+  }
+
+  free(j.code);
+  free(j.bails);
+  return jit;
+}
+
+void ljit_compile(lenv* e, lval* f) {
+  f->jit_epoch = lcur->epoch;
+  if (f->formals->count > LJIT_MAX_ARGS) { return; }
+  if (lval_has_sym(f->formals, "&")) { return; }
+
+  /* Captured variables, and names looked up where f was made, aren't among the native arguments */
+  if (f->caps || f->scope) { return; }
+
+  f->jit = ljit_assemble(e, f, LJIT_INT);
+  if (!f->jit) { f->jit = ljit_assemble(e, f, LJIT_BOOL); }
+}
+
+void ljit_free(lval* f) {
+  if (!f->jit) { return; }
+  munmap(f->jit->code, f->jit->size);
+  free(f->jit);
+  f->jit = NULL;
+}
+
+/* Run f natively if possible, NULL when the interpreter must do it */
+lval* ljit_call(lenv* e, lval* f, lval* a) {
+  /* Native code doesn't count steps or calls, or check the clock */
+  if (lcur->limits.steps || lcur->limits.depth || lcur->limits.time_ms) { return NULL; }
+  if (f->jit_epoch != lcur->epoch) { ljit_compile(lenv_top(e), f); }
+  if (!f->jit) { return NULL; }
+
+  long args[LJIT_MAX_ARGS];
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type != LVAL_NUM) { return NULL; }
+    args[i] = a->cell[i]->num;
+  }
+
+  if (!lcur->stack_limit) { return NULL; }
+
+  ljit_ctx ctx;
+  ctx.bail = 0;
+  ctx.limit = lcur->stack_limit;
+  long r = ((ljit_fn) f->jit->code)(args, &ctx);
+
+  /* Interpreting the call would take even more stack */
+  if (ctx.bail & LJIT_BAIL_STACK) {
+    lquota_breach(LQUOTA_STACK);
+    return lquota_err();
+  }
+  if (ctx.bail) { return NULL; }
+
+  return f->jit->type == LJIT_BOOL ? lval_bln(r) : lval_num(r);
+}
+
+#else
+
+void ljit_free(lval* f) {}
+
+lval* ljit_call(lenv* e, lval* f, lval* a) { return NULL; }
+
+#endif
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+void lenv_add_port(lenv* e, char* name, lport* p) {
+  p->refs++;
+  lval* k = lval_sym(name);
+  lval* v = lval_port(p);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+void lenv_add_builtins(lenv* e) {
+  /* Variable Functions */
+  lenv_add_builtin(e, "\\",  builtin_lambda);
+  lenv_add_builtin(e, "def", builtin_def);
+  lenv_add_builtin(e, "=",   builtin_put);
+  lenv_add_builtin(e, "fun", builtin_fun);
+  lenv_add_builtin(e, "locals", builtin_locals);
+
+  /* Macro Functions */
+  lenv_add_builtin(e, "defmacro", builtin_defmacro);
+  lenv_add_builtin(e, "macroexpand", builtin_macroexpand);
+
+  /* List Functions */
+  lenv_add_builtin(e, "list", builtin_list);
+  lenv_add_builtin(e, "head", builtin_head);
+  lenv_add_builtin(e, "tail", builtin_tail);
+  lenv_add_builtin(e, "eval", builtin_eval);
+  lenv_add_builtin(e, "join", builtin_join);
+
+  /* Q-Expression Functions */
+  lenv_add_builtin(e, "cons", builtin_cons);
+  lenv_add_builtin(e, "len", builtin_len);
+  lenv_add_builtin(e, "init", builtin_init);
+  lenv_add_builtin(e, "sort", builtin_sort);
+  lenv_add_builtin(e, "sort-by", builtin_sort_by);
 
   /* Mathematical Functions */
   lenv_add_builtin(e, "+", builtin_add);
@@ -943,120 +5866,296 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "&&", builtin_and);
   lenv_add_builtin(e, "!", builtin_not);
 
+  /* Special Forms */
+  lenv_add_builtin(e, "do", builtin_do);
+  lenv_add_builtin(e, "let", builtin_let);
+  lenv_add_builtin(e, "select", builtin_select);
+  lenv_add_builtin(e, "case", builtin_case);
+
   /* String Functions */
   lenv_add_builtin(e, "load",  builtin_load);
   lenv_add_builtin(e, "error", builtin_error);
+  lenv_add_builtin(e, "throw", builtin_throw);
+  lenv_add_builtin(e, "try",   builtin_try);
   lenv_add_builtin(e, "print", builtin_print);
 
+  /* Port Functions */
+  lenv_add_builtin(e, "open", builtin_open);
+  lenv_add_builtin(e, "close", builtin_close);
+  lenv_add_builtin(e, "flush", builtin_flush);
+  lenv_add_builtin(e, "read", builtin_read);
+  lenv_add_builtin(e, "read-line", builtin_read_line);
+  lenv_add_builtin(e, "write", builtin_write);
+  lenv_add_builtin(e, "each-line", builtin_each_line);
+  lenv_add_port(e, "stdin", lcur->in);
+  lenv_add_port(e, "stdout", lcur->out);
+
+  /* Delimited File Functions */
+  lenv_add_builtin(e, "read-csv", builtin_read_csv);
+  lenv_add_builtin(e, "read-csv-row", builtin_read_csv_row);
+
+  /* Reloading Functions */
+  lenv_add_builtin(e, "reload", builtin_reload);
+  lenv_add_builtin(e, "watch", builtin_watch);
+
+  /* Asynchronous I/O Functions */
+#ifndef _WIN32
+  lenv_add_builtin(e, "async-read", builtin_async_read);
+  lenv_add_builtin(e, "async-write", builtin_async_write);
+  lenv_add_builtin(e, "async-ready", builtin_async_ready);
+  lenv_add_builtin(e, "async-await", builtin_async_await);
+#endif
+
+  /* Serialization Functions */
+#ifndef _WIN32
+  lenv_add_builtin(e, "save", builtin_save);
+  lenv_add_builtin(e, "restore", builtin_restore);
+#endif
+
+  /* Heap Profiling Functions */
+  lenv_add_builtin(e, "heap-snapshot", builtin_heap_snapshot);
+  lenv_add_builtin(e, "heap-diff", builtin_heap_diff);
+
+  /* Regular Expression Functions */
+#ifndef _WIN32
+  lenv_add_builtin(e, "re-match", builtin_re_match);
+  lenv_add_builtin(e, "re-find-all", builtin_re_find_all);
+  lenv_add_builtin(e, "re-replace", builtin_re_replace);
+  lenv_add_builtin(e, "re-split", builtin_re_split);
+#endif
+
+  /* Coroutine Functions */
+#ifndef _WIN32
+  lenv_add_builtin(e, "spawn", builtin_spawn);
+#endif
+  lenv_add_builtin(e, "yield", builtin_yield);
+  lenv_add_builtin(e, "chan-new", builtin_chan_new);
+  lenv_add_builtin(e, "chan-send", builtin_chan_send);
+  lenv_add_builtin(e, "chan-recv", builtin_chan_recv);
+  lenv_add_builtin(e, "chan-close", builtin_chan_close);
+
   /* Other Functions */
   lenv_add_builtin(e, "exit", builtin_exit);
+  lenv_add_builtin(e, "runtime-stats", builtin_runtime_stats);
+  lenv_add_builtin(e, "optimized-body", builtin_optimized_body);
 }
 
-/* File loading */
-void lenv_load_file(lenv* e, char* filename) {
-  printf("Loading '%s'\n", filename);
-  lval* args = lval_add(lval_sexpr(), lval_str(filename));
-  lval* x = builtin_load(e, args);
-  if (x->type == LVAL_ERR) {
-    lval_println(x);
+/* Evaluation */
+
+lval* lval_apply(lenv* e, lval* f, lval* a);
+
+lval* lval_call(lenv* e, lval* f, lval* a) {
+  lstats.calls++;
+  if (++lstats.depth > lstats.max_depth) { lstats.max_depth = lstats.depth; }
+  LTRACE(call__entry, f->builtin != NULL, lstats.depth);
+
+  if (lcur->limits.depth && lstats.depth > lcur->limits.depth) { lquota_breach(LQUOTA_DEPTH); }
+
+  /* Unwind rather than overflow the C stack, whatever the limits */
+  char here;
+  if ((uintptr_t) &here < lcur->stack_limit) { lquota_breach(LQUOTA_STACK); }
+
+  lval* x;
+  if (lcur->breach) {
+    lval_del(a);
+    x = lquota_err();
+  } else {
+    x = lval_apply(e, f, a);
   }
-}
 
-/* Evaluation */
+  LTRACE(call__return, x->type, lstats.depth);
+  lstats.depth--;
+  return x;
+}
 
-lval* lval_call(lenv* e, lval* f, lval* a) {
+lval* lval_apply(lenv* e, lval* f, lval* a) {
 
   if (f->builtin) { return f->builtin(e, a); }
 
-  int given = a->count;
-  int total = f->formals->count;
-
-  while (a->count) {
-
-    if (f->formals->count == 0) {
-      lval_del(a);
-      return lval_err("Function passed too many arguments. "
-        "Got %i, Expected %i.", given, total);
+  /* Partial application, prepend the bound arguments */
+  if (f->callee) {
+    lval* args = lval_sexpr();
+    args->count = f->count + a->count;
+    args->cell = malloc(sizeof(lval*) * args->count);
+    for (int i = 0; i < f->count; i++) {
+      args->cell[i] = lval_copy(f->cell[i]);
     }
+    memcpy(args->cell + f->count, a->cell, sizeof(lval*) * a->count);
+    lquota_heap(sizeof(lval*) * f->count);
+    free(a->cell);
+    lval_free(a);
+    return lval_call(e, f->callee, args);
+  }
 
-    lval* sym = lval_pop(f->formals, 0);
-
-    if (strcmp(sym->sym, "&") == 0) {
+  /* The callee is shared, so it is never modified */
+  lval* formals = f->formals;
+  int given = a->count;
+  int total = formals->count;
 
-      if (f->formals->count != 1) {
+  int required = total;
+  for (int i = 0; i < total; i++) {
+    if (strcmp(formals->cell[i]->sym, "&") == 0) {
+      if (i != total - 2) {
         lval_del(a);
         return lval_err("Function format invalid. "
           "Symbol '&' not followed by single symbol.");
       }
-
-      lval* nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
-      lval_del(sym); lval_del(nsym);
+      required = i;
       break;
     }
+  }
 
-    lval* val = lval_pop(a, 0);
-    lenv_put(f->env, sym, val);
-    lval_del(sym); lval_del(val);
+  if (required == total && given > total) {
+    lval_del(a);
+    return lval_err("Function passed too many arguments. "
+      "Got %i, Expected %i.", given, total);
   }
 
-  lval_del(a);
+  /* Too few arguments, bind what we have */
+  if (given < required) { return lval_partial(f, a); }
 
-  if (f->formals->count > 0 &&
-    strcmp(f->formals->cell[0]->sym, "&") == 0) {
+  if (f->epoch != lcur->epoch) { lval_optimize(e, f); }
 
-    if (f->formals->count != 2) {
-      return lval_err("Function format invalid. "
-        "Symbol '&' not followed by single symbol.");
-    }
+  if (lcur->jit && required == total) {
+    lval* x = ljit_call(e, f, a);
+    if (x) { lval_del(a); return x; }
+  }
 
-    lval_del(lval_pop(f->formals, 0));
+  /* Lexical scope: the arguments, then the captures, then the globals */
+  lenv* env = lenv_new();
+  env->par = lenv_top(e);
+  env->caps = f->caps;
+  env->scope = f->scope;
 
-    lval* sym = lval_pop(f->formals, 0);
-    lval* val = lval_qexpr();
-    lenv_put(f->env, sym, val);
-    lval_del(sym); lval_del(val);
+  for (int i = 0; i < required; i++) {
+    lenv_bind(env, formals->cell[i], a->cell[i]);
   }
 
-  if (f->formals->count == 0) {
-    f->env->par = e;
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    return lval_copy(f);
+  /* Remaining arguments are collected after '&' */
+  if (required < total) {
+    lval* rest = lval_qexpr();
+    rest->count = given - required;
+    rest->cell = malloc(sizeof(lval*) * rest->count);
+    memcpy(rest->cell, a->cell + required, sizeof(lval*) * rest->count);
+    lenv_bind(env, formals->cell[total-1], rest);
   }
 
+  lquota_heap(-(long) sizeof(lval*) * required);
+  free(a->cell);
+  lval_free(a);
+
+  /* Pinned, as a redefinition while it runs would optimize f again */
+  lval* body = f->opt;
+  body->refs++;
+  lval* x = lval_eval_cells(env, body->cell, body->count);
+  if (--body->refs == 0 && body != f->opt) { lval_del(body); }
+  lenv_close(env, f);
+  return x;
+}
+
+/* Special forms see their arguments unevaluated and borrowed */
+struct { lbuiltin builtin; lform form; } lforms[] = {
+  { builtin_if, lform_if },
+  { builtin_and, lform_and },
+  { builtin_or, lform_or },
+  { builtin_do, lform_do },
+  { builtin_let, lform_let },
+  { builtin_select, lform_select },
+  { builtin_case, lform_case },
+  { NULL, NULL }
+};
+
+lform lform_find(lbuiltin f) {
+  for (int i = 0; lforms[i].builtin; i++) {
+    if (lforms[i].builtin == f) { return lforms[i].form; }
+  }
+  return NULL;
 }
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+/*
+ * The evaluator borrows the expression it is given, so lambda bodies and
+ * the branches of special forms are run in place rather than copied first.
+ * Only the values produced are allocated.
+ */
+
+lval* lval_eval_cells(lenv* e, lval** cell, int count) {
+  if (lquota_step()) { return lquota_err(); }
+  if (count == 0) { return lval_sexpr(); }
+
+  lval* f;
+  if (cell[0]->type == LVAL_SYM) {
+    lval* h = lenv_find(e, cell[0]->sym);
+    if (!h) { return lval_err_code(LERR_UNBOUND, "Unbound Symbol '%s'", cell[0]->sym); }
+    if (h->type == LVAL_FUN && h->builtin) {
+      lform form = lform_find(h->builtin);
+      if (form) { return form(e, cell + 1, count - 1); }
+    } else if (h->type == LVAL_FUN && h->macro) {
+      return lmacro_eval(e, h, cell, count);
+    }
+    f = lval_copy(h);
+  } else {
+    f = lval_eval_ref(e, cell[0]);
+    if (f->type == LVAL_ERR) { return f; }
+  }
 
-  for (int i = 0; i < v->count; i++) { v->cell[i] = lval_eval(e, v->cell[i]); }
-  for (int i = 0; i < v->count; i++) { if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); } }
+  if (count == 1) { return lval_eval(e, f); }
 
-  if (v->count == 0) { return v; }
-  if (v->count == 1) { return lval_eval(e, lval_take(v, 0)); }
+  /* Stop at the first error, the remaining arguments are never evaluated */
+  lval* a = lval_sexpr();
+  a->cell = malloc(sizeof(lval*) * (count - 1));
+  for (int i = 1; i < count; i++) {
+    lval* x = lval_eval_ref(e, cell[i]);
+    if (x->type == LVAL_ERR) { lval_del(a); lval_del(f); return x; }
+    a->cell[a->count++] = x;
+    lquota_heap(sizeof(lval*));
+  }
 
-  lval* f = lval_pop(v, 0);
   if (f->type != LVAL_FUN) {
     lval* err = lval_err(
       "S-Expression starts with incorrect type. "
       "Got %s, Expected %s.",
       ltype_name(f->type), ltype_name(LVAL_FUN));
-    lval_del(f); lval_del(v);
+    lval_del(f); lval_del(a);
     return err;
   }
 
-  lval* result = lval_call(e, f, v);
+  uint32_t site = lcur->heap ? lheap_enter(cell[0]) : 0;
+  lval* result = lval_call(e, f, a);
+  lcur->site = site;
   lval_del(f);
   return result;
 }
 
+lval* lval_eval_ref(lenv* e, lval* v) {
+  if (v->type == LVAL_SYM) { return lenv_get(e, v); }
+  if (v->type == LVAL_SEXPR) { return lval_eval_cells(e, v->cell, v->count); }
+  return lval_copy(v);
+}
+
+/* Symbol values and literals are borrowed, anything made is also put in *tmp */
+lval* lval_eval_borrow(lenv* e, lval* v, lval** tmp) {
+  *tmp = NULL;
+  if (v->type == LVAL_SYM) {
+    lval* x = lenv_find(e, v->sym);
+    if (x && x->type != LVAL_ERR) { return x; }
+  } else if (v->type != LVAL_SEXPR && v->type != LVAL_ERR) {
+    return v;
+  }
+  *tmp = lval_eval_ref(e, v);
+  return *tmp;
+}
+
 lval* lval_eval(lenv* e, lval* v) {
   if (v->type == LVAL_SYM) {
     lval* x = lenv_get(e, v);
     lval_del(v);
     return x;
   }
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+  if (v->type == LVAL_SEXPR) {
+    lval* x = lval_eval_cells(e, v->cell, v->count);
+    lval_del(v);
+    return x;
+  }
   return v;
 }
 
@@ -1096,49 +6195,182 @@ lval* lval_read_bool(mpc_ast_t* t) {
                                           : lval_bln(false);
 }
 
-lval* lval_read(mpc_ast_t* t) {
-
+/* Value of a number, string, symbol or bool, NULL for an expression */
+lval* lval_read_atom(mpc_ast_t* t) {
   if (strstr(t->tag, "number")) { return lval_read_num(t); }
   if (strstr(t->tag, "string")) { return lval_read_str(t); }
   if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
   if (strstr(t->tag, "bool")) { return lval_read_bool(t); }
+  return NULL;
+}
+
+bool lval_read_skip(mpc_ast_t* t) {
+  if (strcmp(t->contents, "(") == 0) { return true; }
+  if (strcmp(t->contents, ")") == 0) { return true; }
+  if (strcmp(t->contents, "}") == 0) { return true; }
+  if (strcmp(t->contents, "{") == 0) { return true; }
+  if (strcmp(t->tag,  "regex") == 0) { return true; }
+  if (strstr(t->tag, "comment")) { return true; }
+  return false;
+}
 
+/* Expression holding its atoms, pushing nested expressions and their slots to read */
+lval* lval_read_expr(mpc_ast_t* t, lstack* s) {
   lval* x = NULL;
   if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
   if (strstr(t->tag, "sexpr"))  { x = lval_sexpr(); }
   if (strstr(t->tag, "qexpr"))  { x = lval_qexpr(); }
 
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->tag,  "regex") == 0) { continue; }
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
-    x = lval_add(x, lval_read(t->children[i]));
+  for (int i = 0; i < t->children_num; i++) { x->count += !lval_read_skip(t->children[i]); }
+  if (x->count) { x->cell = malloc(sizeof(lval*) * x->count); }
+  lquota_heap(sizeof(lval*) * x->count);
+
+  for (int i = t->children_num - 1, n = x->count; i >= 0; i--) {
+    mpc_ast_t* c = t->children[i];
+    if (lval_read_skip(c)) { continue; }
+    n--;
+    x->cell[n] = lval_read_atom(c);
+    if (!x->cell[n]) { lstack_push2(s, c, &x->cell[n]); }
   }
+  return x;
+}
 
+/* Code read to be evaluated isn't counted against the heap limit */
+lval* lval_read(mpc_ast_t* t) {
+  long used = lcur->heap_used;
+  lval* x = lval_read_atom(t);
+  if (!x) {
+    lstack s;
+    lstack_init(&s);
+    x = lval_read_expr(t, &s);
+    while (s.count) {
+      lval** slot = lstack_pop(&s);
+      mpc_ast_t* c = lstack_pop(&s);
+      *slot = lval_read_expr(c, &s);
+    }
+    lstack_free(&s);
+  }
+  lcur->heap_base += lcur->heap_used - used;
   return x;
 }
 
-/* Main */
+/* Batch Mode */
 
-int main(int argc, char** argv) {
+enum { LPRINT_ALL, LPRINT_VALUES, LPRINT_NONE };
+
+void lval_print_result(lval* x, int print_mode) {
+  if (x->type == LVAL_ERR) {
+    /* Output printed before the error comes first */
+    lbuf_flush(&lcur->out->out);
+    lval_print(&lcur->err->out, x);
+    lbuf_putc(&lcur->err->out, '\n');
+    lbuf_flush(&lcur->err->out);
+    return;
+  }
+  if (print_mode == LPRINT_NONE) { return; }
+  if (print_mode == LPRINT_VALUES && x->type == LVAL_SEXPR && x->count == 0) { return; }
+  lval_println(x);
+}
+
+/* Evaluate every form in source, returning 1 if any of them failed */
+int lenv_eval_source(lenv* e, char* name, char* source, int print_mode) {
+  lquota_start();
+
+  mpc_result_t r;
+  if (!mpc_parse(name, source, lcur->Lispy, &r)) {
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    lbuf_flush(&lcur->out->out);
+    lbuf_puts(&lcur->err->out, err_msg);
+    lbuf_flush(&lcur->err->out);
+    free(err_msg);
+    return 1;
+  }
+
+  lval* expr = lval_read(r.output);
+  mpc_ast_delete(r.output);
+
+  int status = 0;
+  while (expr->count) {
+    lval* x = lval_eval(e, lval_pop(expr, 0));
+    if (lcur->exited) { lval_del(x); break; }
+    if (x->type == LVAL_ERR) { status = 1; }
+    lval_print_result(x, print_mode);
+    lval_del(x);
+    if (lcur->breach) { break; }
+  }
+
+  lval_del(expr);
+  return status;
+}
+
+/* Read forms from a port, evaluating each line once its forms are complete */
+int lenv_run_batch(lenv* e, lport* in, int print_mode) {
+  lbuf src;
+  lbuf_init(&src, NULL);
+
+  int status = 0;
+  int depth = 0;
+  bool in_str = false;
+
+  lval* line;
+  while ((line = lport_read_line(in))) {
+
+    /* Track nesting, ignoring brackets inside strings and comments */
+    for (char* c = line->str; *c; c++) {
+      if (in_str) {
+        if (*c == '\\' && c[1]) { c++; }
+        else if (*c == '"') { in_str = false; }
+        continue;
+      }
+      if (*c == ';') { break; }
+      if (*c == '"') { in_str = true; }
+      if (*c == '(' || *c == '{') { depth++; }
+      if (*c == ')' || *c == '}') { depth--; }
+    }
+
+    lbuf_puts(&src, line->str);
+    lbuf_putc(&src, '\n');
+    lval_del(line);
+
+    if (depth <= 0 && !in_str) {
+      status |= lenv_eval_source(e, "<stdin>", lbuf_cstr(&src), print_mode);
+      src.len = 0;
+      depth = 0;
+      if (lcur->exited) { break; }
+    }
+  }
 
-  Number  = mpc_new("number");
-  Symbol  = mpc_new("symbol");
-  String  = mpc_new("string");
-  Bool    = mpc_new("bool");
-  Comment = mpc_new("comment");
-  Sexpr   = mpc_new("sexpr");
-  Qexpr   = mpc_new("qexpr");
-  Expr    = mpc_new("expr");
-  Lispy   = mpc_new("lispy");
+  /* Unterminated input is reported by the parser */
+  if (src.len && !lcur->exited) {
+    status |= lenv_eval_source(e, "<stdin>", lbuf_cstr(&src), print_mode);
+  }
+
+  lbuf_free(&src);
+  return status;
+}
+
+/* Embedding */
+
+lithpy* lithpy_new(void) {
+  lithpy* ctx = calloc(1, sizeof(lithpy));
+  lithpy* prev = lcur;
+  lcur = ctx;
+
+  ctx->Number  = mpc_new("number");
+  ctx->Symbol  = mpc_new("symbol");
+  ctx->String  = mpc_new("string");
+  ctx->Bool    = mpc_new("bool");
+  ctx->Comment = mpc_new("comment");
+  ctx->Sexpr   = mpc_new("sexpr");
+  ctx->Qexpr   = mpc_new("qexpr");
+  ctx->Expr    = mpc_new("expr");
+  ctx->Lispy   = mpc_new("lispy");
 
   mpca_lang(MPCA_LANG_DEFAULT,
     "                                                \
       number  : /-?[0-9]+([.][0-9]*|[0-9]*)/ ;       \
-      symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\%^=<>!&]+/ ; \
+      symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\%^=<>!&|]+/ ; \
       string  : /\"(\\\\.|[^\"])*\"/ ;               \
       bool    : /(true|false)/ ;                     \
       comment : /;[^\\r\\n]*/ ;                      \
@@ -1149,31 +6381,691 @@ int main(int argc, char** argv) {
               | <qexpr> ;                            \
       lispy   : /^/ <expr>* /$/ ;                    \
     ",
-    Number, Symbol, String, Bool, Comment, Sexpr, Qexpr, Expr, Lispy);
+    ctx->Number, ctx->Symbol, ctx->String, ctx->Bool, ctx->Comment,
+    ctx->Sexpr, ctx->Qexpr, ctx->Expr, ctx->Lispy);
+
+  ctx->in = lport_new(stdin);
+  ctx->out = lport_new(stdout);
+  ctx->err = lport_new(stderr);
+  ctx->in->tie = ctx->out;
+  ctx->jit = true;
+  ctx->watch_fd = -1;
+
+  ctx->env = lenv_new();
+  lenv_add_builtins(ctx->env);
+
+  lcur = prev;
+  return ctx;
+}
+
+void lithpy_delete(lithpy* ctx) {
+  lithpy* prev = lcur;
+  lcur = ctx;
+
+  lsched_free();
+  laio_free();
+  lre_free();
+  lsource_free();
+  lenv_del(ctx->env);
+  lport_release(ctx->in);
+  lport_release(ctx->out);
+  lport_release(ctx->err);
+  lerr_free_spare();
+
+  /* Anything left was never released */
+  if (ctx->heap) {
+    lheap* h = ctx->heap;
+    ctx->heap = NULL;
+    lheap_report(h, stderr);
+    lheap_free(h);
+  }
+
+  mpc_cleanup(9,
+    ctx->Number, ctx->Symbol, ctx->String, ctx->Bool, ctx->Comment,
+    ctx->Sexpr,  ctx->Qexpr,  ctx->Expr,   ctx->Lispy);
+
+  free(ctx);
+  lcur = prev == ctx ? NULL : prev;
+}
+
+/* Evaluates every form, returning the last value or the first error */
+lithpy_value* lithpy_eval_string(lithpy* ctx, const char* name, const char* source) {
+  lithpy* prev = lcur;
+  lcur = ctx;
+  lsource_poll(ctx->env);
+  lquota_start();
+
+  mpc_result_t r;
+  lval* x;
+  if (mpc_parse(name, source, ctx->Lispy, &r)) {
+    lval* expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    x = lval_sexpr();
+    while (expr->count && x->type != LVAL_ERR) {
+      lval_del(x);
+      x = lval_eval(ctx->env, lval_pop(expr, 0));
+    }
+    lval_del(expr);
+  } else {
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+    x = lval_err("%s", err_msg);
+    free(err_msg);
+  }
+
+  lbuf_flush(&ctx->out->out);
+  lcur = prev;
+  return x;
+}
+
+lithpy_value* lithpy_eval_file(lithpy* ctx, const char* filename) {
+  lithpy* prev = lcur;
+  lcur = ctx;
+  lsource_poll(ctx->env);
+  lquota_start();
+  lval* x = builtin_load(ctx->env, lval_add(lval_sexpr(), lval_str((char*) filename)));
+  lbuf_flush(&ctx->out->out);
+  lcur = prev;
+  return x;
+}
+
+void lithpy_register(lithpy* ctx, const char* name, lithpy_builtin func) {
+  lithpy* prev = lcur;
+  lcur = ctx;
+  lenv_add_builtin(ctx->env, (char*) name, func);
+  lcur = prev;
+}
+
+void lithpy_set_limits(lithpy* ctx, lithpy_limits limits) {
+  ctx->limits = limits;
+}
+
+void lithpy_heap_profile(lithpy* ctx) {
+  if (!ctx->heap) { ctx->heap = lheap_new(); }
+}
+
+bool lithpy_exited(lithpy* ctx, int* status) {
+  if (status) { *status = ctx->exit_status; }
+  return ctx->exited;
+}
+
+/* Values built outside of a context are not counted in its statistics */
+lithpy_value* lithpy_number(long x) { return lval_num(x); }
+lithpy_value* lithpy_string(const char* s) { return lval_str((char*) s); }
+
+lithpy_value* lithpy_error(const char* msg) {
+  return lval_err_user(NULL, (char*) msg, lval_str((char*) msg));
+}
+
+void lithpy_value_delete(lithpy_value* v) { lval_del(v); }
 
-  lenv* e = lenv_new();
-  lenv_add_builtins(e);
+bool lithpy_is_error(lithpy_value* v)  { return v->type == LVAL_ERR; }
+bool lithpy_is_number(lithpy_value* v) { return v->type == LVAL_NUM; }
+bool lithpy_is_string(lithpy_value* v) { return v->type == LVAL_STR; }
+
+long lithpy_to_number(lithpy_value* v) { return v->type == LVAL_NUM ? v->num : 0; }
+
+const char* lithpy_to_string(lithpy_value* v) {
+  if (v->type == LVAL_STR) { return v->str; }
+  if (v->type == LVAL_ERR) { return lerr_message(v->err); }
+  return NULL;
+}
+
+char* lithpy_print(lithpy_value* v) {
+  lbuf b;
+  lbuf_init(&b, NULL);
+  lval_print(&b, v);
+  return lbuf_cstr(&b);
+}
+
+int lithpy_count(lithpy_value* args) { return args->count; }
+lithpy_value* lithpy_arg(lithpy_value* args, int i) { return args->cell[i]; }
+
+/* Server Mode */
+
+#ifndef _WIN32
+
+volatile sig_atomic_t lserver_stop = 0;
+
+void lserver_signal(int sig) { lserver_stop = 1; }
+
+int write_all(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n <= 0) { return -1; }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*
+ * Evaluate one request in a fresh environment on top of the shared one.
+ * The client sends source and shuts down its write side; all output goes
+ * back on the connection followed by a trailer of '\0' and the exit status,
+ * as a single byte just as a process exit status is.
+ */
+void lserver_handle(lenv* e, int fd) {
+  lbuf src;
+  lbuf_init(&src, NULL);
+
+  char chunk[LBUF_SIZE / 4];
+  ssize_t n;
+  while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0) { break; }
+    lbuf_write(&src, chunk, n);
+  }
+
+  FILE* conn = fdopen(fd, "w");
+  if (!conn) { close(fd); lbuf_free(&src); return; }
+
+  /* Redirect both output ports to the client */
+  lcur->out->file = lcur->out->out.file = conn;
+  lcur->err->file = lcur->err->out.file = conn;
+
+  lenv* req = lenv_new();
+  req->par = e;
+  int status = lenv_eval_source(req, "<client>", lbuf_cstr(&src), LPRINT_VALUES);
+  lsched_drain();
+  lsched_free();
+  lenv_del(req);
+
+  /* Exiting ends the request, not the worker */
+  if (lcur->exited) { status = lcur->exit_status; lcur->exited = false; }
+
+  lbuf_flush(&lcur->out->out);
+  lbuf_flush(&lcur->err->out);
+  fputc('\0', conn);
+  fputc(status & 0xff, conn);
+  fclose(conn);
+
+  lcur->out->file = lcur->out->out.file = stdout;
+  lcur->err->file = lcur->err->out.file = stderr;
+  lbuf_free(&src);
+}
+
+pid_t lserver_spawn(lenv* e, int sock) {
+  pid_t pid = fork();
+  if (pid != 0) { return pid; }
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  while (1) {
+    int fd = accept(sock, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) { continue; }
+      perror("accept");
+      exit(1);
+    }
+    lserver_handle(e, fd);
+  }
+}
+
+/* Serve requests on a Unix socket with a fixed pool of forked workers */
+int lserver_run(lenv* e, char* path, int workers) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path '%s' is too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (sock < 0
+    || bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0
+    || listen(sock, 128) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  /* Flush anything printed while warming up, so workers don't repeat it */
+  lbuf_flush(&lcur->out->out);
+  lcur->shared = e;
+
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lserver_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  pid_t* pids = malloc(sizeof(pid_t) * workers);
+  for (int i = 0; i < workers; i++) { pids[i] = lserver_spawn(e, sock); }
+
+  /* Replace workers that die until asked to stop */
+  while (!lserver_stop) {
+    pid_t pid = wait(NULL);
+    if (pid < 0) { continue; }
+    for (int i = 0; i < workers; i++) {
+      if (pids[i] == pid) { pids[i] = lserver_spawn(e, sock); }
+    }
+  }
+
+  for (int i = 0; i < workers; i++) { kill(pids[i], SIGTERM); }
+  while (wait(NULL) > 0) {}
+
+  free(pids);
+  close(sock);
+  unlink(path);
+  lcur->shared = NULL;
+  return 0;
+}
+
+/* Send files (or stdin) to a server and copy back its output */
+int lclient_run(char* path, int count, char** files) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path '%s' is too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    perror(path);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  char chunk[LBUF_SIZE];
+  for (int i = 0; i < (count ? count : 1); i++) {
+    FILE* f = count ? fopen(files[i], "rb") : stdin;
+    if (!f) { perror(files[i]); close(fd); return 1; }
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+      if (write_all(fd, chunk, n) < 0) { break; }
+    }
+    if (f != stdin) { fclose(f); }
+    if (write_all(fd, "\n", 1) < 0) { break; }
+  }
+  shutdown(fd, SHUT_WR);
+
+  /* Hold back the last two bytes, which are the status trailer */
+  char held[2];
+  size_t nheld = 0;
+  ssize_t n;
+  while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+    if (n < 0 && errno == EINTR) { continue; }
+    if (n < 0) { break; }
+    size_t total = nheld + n;
+    if (total <= 2) {
+      memcpy(held + nheld, chunk, n);
+      nheld = total;
+      continue;
+    }
+    /* Write all but the last two bytes, wherever they are */
+    size_t out = total - 2;
+    size_t from_held = out < nheld ? out : nheld;
+    fwrite(held, 1, from_held, stdout);
+    memmove(held, held + from_held, nheld - from_held);
+    nheld -= from_held;
+    fwrite(chunk, 1, out - from_held, stdout);
+    memcpy(held + nheld, chunk + out - from_held, n - (out - from_held));
+    nheld = 2;
+  }
+  close(fd);
+
+  if (nheld == 2 && held[0] == '\0') { return (unsigned char) held[1]; }
+  fwrite(held, 1, nheld, stdout);
+  fprintf(stderr, "Connection to '%s' closed unexpectedly\n", path);
+  return 1;
+}
+
+#endif
+
+/* Main */
+
+#ifndef LITHPY_NO_MAIN
+
+void usage(void) {
+  fputs("Usage: lithpy [options] [file ...]\n"
+        "  -e, --stdin     Evaluate forms from stdin without the REPL\n"
+        "  --print=MODE    Print results in batch mode: all, values or none\n"
+        "  -q              Same as --print=none\n"
+        "  --no-jit        Never compile lambdas to native code\n"
+        "  --stats         Print runtime statistics to stderr at exit\n"
+        "  --heap-profile  Track live values for heap-snapshot, report leaks at exit\n"
+        "  --max-heap N    Limit each evaluation to N bytes of values (k, m or g suffix)\n"
+        "  --max-steps N   Limit each evaluation to N expressions\n"
+        "  --max-depth N   Limit nested function calls to N\n"
+        "  --timeout SECS  Limit each evaluation to SECS seconds\n"
+        "  --server PATH   Keep a warm interpreter serving requests on socket PATH\n"
+        "  --workers N     Number of server worker processes (default 4)\n"
+        "  --client PATH   Send files or stdin to the server on socket PATH\n", stderr);
+}
+
+void lstats_dump(void) {
+  lval* x = lstats_list();
+  lbuf b;
+  lbuf_init(&b, NULL);
+  for (int i = 0; i < x->count; i++) {
+    lval* item = x->cell[i];
+    lbuf_printf(&b, "%-14s", item->cell[0]->str);
+    if (item->cell[1]->type == LVAL_QEXPR) {
+      for (int j = 0; j < item->cell[1]->count; j++) {
+        lval* pair = item->cell[1]->cell[j];
+        lbuf_printf(&b, " %s=%li", pair->cell[0]->str, pair->cell[1]->num);
+      }
+    } else {
+      lbuf_putc(&b, ' ');
+      lval_print(&b, item->cell[1]);
+    }
+    lbuf_putc(&b, '\n');
+  }
+  fputs(lbuf_cstr(&b), stderr);
+  lbuf_free(&b);
+  lval_del(x);
+}
+
+/* Count with an optional k, m or g suffix, -1 if malformed */
+long parse_size(char* s) {
+  char* end;
+  long n = strtol(s, &end, 10);
+  if (end == s || n < 0) { return -1; }
+  if (*end == 'k' || *end == 'K') { n <<= 10; end++; }
+  else if (*end == 'm' || *end == 'M') { n <<= 20; end++; }
+  else if (*end == 'g' || *end == 'G') { n <<= 30; end++; }
+  return *end ? -1 : n;
+}
+
+/* Parallel Parsing */
+
+/*
+ * The libraries and the files named on the command line are parsed up front
+ * on worker threads, which only build mpc syntax trees. Reading the trees
+ * into values and evaluating them stays on the main thread, in order. If no
+ * worker has started on the next file yet the main thread parses it itself,
+ * so with a single core this does the same work as loading one by one.
+ * A file is hashed again when its turn comes and parsed again if an earlier
+ * one changed it.
+ */
+
+#define LPARSE_AHEAD 2
+
+enum { LPARSE_QUEUED, LPARSE_RUNNING, LPARSE_DONE, LPARSE_TAKEN };
+
+typedef struct {
+  char* filename;
+  int state;
+  bool parsed;
+  mpc_result_t r;
+  uint64_t hash;  /* Of the contents when parsed, 0 if unreadable */
+} lparse_file;
+
+typedef struct {
+  mpc_parser_t* parser;
+  lparse_file* files;
+  int count;
+  int taken;
+  bool stop;
+#ifndef _WIN32
+  int ahead;
+  int nthreads;
+  pthread_t* threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+#endif
+} lparse_pool;
+
+/* Hash of a file's contents, 0 if it can't be read */
+uint64_t lparse_stamp(char* filename) {
+  size_t size;
+  char* data = lcsv_load(filename, &size);
+  if (!data) { return 0; }
+  uint64_t h = lsource_hash(data, size);
+  lcsv_unload(data, size);
+  return h;
+}
+
+/* Hashed first, so a write racing the parse makes the file look changed */
+void lparse_run(lparse_pool* p, lparse_file* f) {
+  f->hash = lparse_stamp(f->filename);
+  f->parsed = mpc_parse_contents(f->filename, p->parser, &f->r);
+}
+
+#ifndef _WIN32
+
+/* Parse queued files in order, staying a few ahead of the evaluation */
+void* lparse_worker(void* arg) {
+  lparse_pool* p = arg;
+  pthread_mutex_lock(&p->lock);
+  while (!p->stop) {
+    int i = p->taken;
+    while (i < p->count && p->files[i].state != LPARSE_QUEUED) { i++; }
+    if (i == p->count) { break; }
+    if (i >= p->taken + p->ahead) {
+      pthread_cond_wait(&p->work, &p->lock);
+      continue;
+    }
+
+    lparse_file* f = &p->files[i];
+    f->state = LPARSE_RUNNING;
+    pthread_mutex_unlock(&p->lock);
+    lparse_run(p, f);
+    pthread_mutex_lock(&p->lock);
+    f->state = LPARSE_DONE;
+    pthread_cond_broadcast(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+#endif
+
+lparse_pool* lparse_start(mpc_parser_t* parser, char** filenames, int count) {
+  lparse_pool* p = calloc(1, sizeof(lparse_pool));
+  p->parser = parser;
+  p->count = count;
+  p->files = calloc(count, sizeof(lparse_file));
+  for (int i = 0; i < count; i++) { p->files[i].filename = filenames[i]; }
+
+#ifndef _WIN32
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->done, NULL);
+
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int n = cores > 1 ? (cores < count ? cores : count) : 0;
+  p->ahead = n * LPARSE_AHEAD;
+  p->threads = calloc(n, sizeof(pthread_t));
+  for (; p->nthreads < n; p->nthreads++) {
+    if (pthread_create(&p->threads[p->nthreads], NULL, lparse_worker, p) != 0) { break; }
+  }
+#endif
+
+  return p;
+}
+
+/* Wait for the i-th file, parsing it here if no worker has started it */
+lparse_file* lparse_take(lparse_pool* p, int i) {
+  lparse_file* f = &p->files[i];
+#ifndef _WIN32
+  pthread_mutex_lock(&p->lock);
+  bool claimed = f->state == LPARSE_QUEUED;
+  if (claimed) { f->state = LPARSE_RUNNING; }
+  while (!claimed && f->state != LPARSE_DONE) { pthread_cond_wait(&p->done, &p->lock); }
+  f->state = LPARSE_TAKEN;
+  p->taken = i + 1;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+  if (claimed) { lparse_run(p, f); }
+#else
+  lparse_run(p, f);
+  f->state = LPARSE_TAKEN;
+#endif
+  return f;
+}
+
+void lparse_free(lparse_pool* p) {
+#ifndef _WIN32
+  pthread_mutex_lock(&p->lock);
+  p->stop = true;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->nthreads; i++) { pthread_join(p->threads[i], NULL); }
+  free(p->threads);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->work);
+  pthread_cond_destroy(&p->done);
+#endif
+
+  /* Drop whatever was parsed but never evaluated */
+  for (int i = 0; i < p->count; i++) {
+    lparse_file* f = &p->files[i];
+    if (f->state != LPARSE_DONE) { continue; }
+    if (f->parsed) { mpc_ast_delete(f->r.output); } else { mpc_err_delete(f->r.error); }
+  }
+  free(p->files);
+  free(p);
+}
+
+/* Evaluate the i-th file in the environment, counting forms that failed in failed, if given */
+lval* lparse_load(lparse_pool* p, int i, lenv* e, int* failed) {
+  lparse_file* f = lparse_take(p, i);
+
+  /* An earlier file may have written this one since it was parsed */
+  if (lparse_stamp(f->filename) != f->hash) {
+    if (f->parsed) { mpc_ast_delete(f->r.output); } else { mpc_err_delete(f->r.error); }
+    lparse_run(p, f);
+  }
+  bool parsed = f->parsed;
+  lval* x = lenv_load_parsed(e, f->filename, parsed, &f->r, failed);
+  if (parsed && !lcur->exited && !lcur->breach) { lsource_record(f->filename); }
+  return x;
+}
+
+/* Library loading */
+void lenv_load_file(lenv* e, lparse_pool* p, int i, bool announce) {
+  lquota_start();
+  if (announce) { lbuf_printf(&lcur->out->out, "Loading '%s'\n", p->files[i].filename); }
+  lval* x = lparse_load(p, i, e, NULL);
+  if (x->type == LVAL_ERR && !lcur->exited) {
+    lval_println(x);
+  }
+  lval_del(x);
+}
+
+int main(int argc, char** argv) {
+
+  /* Options */
+  bool batch = false;
+  bool jit = true;
+  bool stats = false;
+  bool heap_profile = false;
+  int print_mode = LPRINT_VALUES;
+  char* server = NULL;
+  char* client = NULL;
+  int workers = 4;
+  lithpy_limits limits = { 0, 0, 0, 0 };
+  bool bad = false;
+
+  int first = 1;
+  for (; first < argc && argv[first][0] == '-'; first++) {
+    char* opt = argv[first];
+    if (strcmp(opt, "--") == 0) { first++; break; }
+    if (strcmp(opt, "-e") == 0 || strcmp(opt, "--stdin") == 0) {
+      batch = true;
+    } else if (strcmp(opt, "-q") == 0 || strcmp(opt, "--print=none") == 0) {
+      print_mode = LPRINT_NONE;
+    } else if (strcmp(opt, "--print=all") == 0) {
+      print_mode = LPRINT_ALL;
+    } else if (strcmp(opt, "--print=values") == 0) {
+      print_mode = LPRINT_VALUES;
+    } else if (strcmp(opt, "--no-jit") == 0) {
+      jit = false;
+    } else if (strcmp(opt, "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(opt, "--heap-profile") == 0) {
+      heap_profile = true;
+    } else if (strcmp(opt, "--server") == 0 && first + 1 < argc) {
+      server = argv[++first];
+    } else if (strcmp(opt, "--client") == 0 && first + 1 < argc) {
+      client = argv[++first];
+    } else if (strcmp(opt, "--workers") == 0 && first + 1 < argc) {
+      workers = atoi(argv[++first]);
+      if (workers < 1) { workers = 1; }
+    } else if (strcmp(opt, "--max-heap") == 0 && first + 1 < argc) {
+      limits.heap = parse_size(argv[++first]);
+      bad = bad || limits.heap < 0;
+    } else if (strcmp(opt, "--max-steps") == 0 && first + 1 < argc) {
+      limits.steps = parse_size(argv[++first]);
+      bad = bad || limits.steps < 0;
+    } else if (strcmp(opt, "--max-depth") == 0 && first + 1 < argc) {
+      limits.depth = parse_size(argv[++first]);
+      bad = bad || limits.depth < 0;
+    } else if (strcmp(opt, "--timeout") == 0 && first + 1 < argc) {
+      char* end;
+      double secs = strtod(argv[++first], &end);
+      limits.time_ms = (long) (secs * 1000);
+      bad = bad || *end || secs < 0;
+    } else {
+      fprintf(stderr, "Unknown option '%s'\n", opt);
+      usage();
+      return 2;
+    }
+    if (bad) {
+      fprintf(stderr, "Invalid value for option '%s'\n", opt);
+      return 2;
+    }
+  }
+
+#ifndef _WIN32
+  /* The client needs none of the interpreter, so it starts instantly */
+  if (client) { return lclient_run(client, argc - first, argv + first); }
+#endif
+
+  lcur = lithpy_new();
+  lcur->jit = jit;
+  lcur->limits = limits;
+  if (heap_profile) { lithpy_heap_profile(lcur); }
+  lenv* e = lcur->env;
+
+  /* Start parsing the standard library and the supplied files */
+  int nfiles = 2 + argc - first;
+  char** filenames = malloc(sizeof(char*) * nfiles);
+  filenames[0] = "src/stdlib/prelude.lspy";
+  filenames[1] = "src/stdlib/fun.lthpy";
+  for (int i = first; i < argc; i++) { filenames[2 + i - first] = argv[i]; }
+  lparse_pool* files = lparse_start(lcur->Lispy, filenames, nfiles);
 
   // Load standard library
-  lenv_load_file(e, "src/stdlib/prelude.lspy");
-  lenv_load_file(e, "src/stdlib/fun.lthpy");
+  lenv_load_file(e, files, 0, !batch && !server);
+  lenv_load_file(e, files, 1, !batch && !server);
+
+  int status = 0;
 
   /* Interactive Prompt */
-  if (argc == 1) {
+  if (first == argc && !batch && !server) {
 
     puts("Lithpy Version 0.0.0.1.0");
     puts("Press Ctrl+c to Exit\n");
 
     while (1) {
 
+      lbuf_flush(&lcur->out->out);
       char* input = readline("lithpy> ");
+      if (!input) { break; }
       add_history(input);
 
+      lsource_poll(e);
+      if (lcur->exited) { free(input); break; }
+
       mpc_result_t r;
-      if (mpc_parse("<stdin>", input, Lispy, &r)) {
+      if (mpc_parse("<stdin>", input, lcur->Lispy, &r)) {
 
+        lquota_start();
         lval* x = lval_eval(e, lval_read(r.output));
-        lval_println(x);
+        if (!lcur->exited) { lval_println(x); }
         lval_del(x);
 
         mpc_ast_delete(r.output);
@@ -1183,33 +7075,52 @@ int main(int argc, char** argv) {
       }
 
       free(input);
+      if (lcur->exited) { break; }
 
     }
   }
 
   /* Supplied with list of files */
-  if (argc >= 2) {
+  if (first < argc) {
 
-    /* loop over each supplied filename (starting from 1) */
-    for (int i = 1; i < argc; i++) {
+    /* loop over each supplied filename */
+    for (int i = first; i < argc && !lcur->exited; i++) {
 
-      /* Argument list with a single argument, the filename */
-      lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
-
-      /* Pass to builtin load and get the result */
-      lval* x = builtin_load(e, args);
+      /* Evaluate the parsed file and get the result */
+      lquota_start();
+      int failed = 0;
+      lval* x = lparse_load(files, 2 + i - first, e, &failed);
 
       /* If the result is an error be sure to print it */
-      if (x->type == LVAL_ERR) { lval_println(x); }
+      if (x->type == LVAL_ERR && !lcur->exited) { lval_println(x); status = 1; }
+      if (failed) { status = 1; }
       lval_del(x);
     }
   }
 
-  lenv_del(e);
+  lparse_free(files);
+  free(filenames);
+
+  /* Evaluate forms streamed on stdin, after any files */
+  if (batch && !lcur->exited) {
+    status |= lenv_run_batch(e, lcur->in, print_mode);
+  }
+
+#ifndef _WIN32
+  /* Serve requests with the files loaded into the shared environment */
+  if (server && !lcur->exited) {
+    status |= lserver_run(e, server, workers);
+  }
+#endif
+
+  /* Let spawned tasks finish */
+  lsched_drain();
 
-  mpc_cleanup(8,
-    Number, Symbol, String, Bool, Comment,
-    Sexpr,  Qexpr,  Expr,   Lispy);
+  if (lcur->exited) { status = lcur->exit_status; }
+  if (stats) { lstats_dump(); }
+  lithpy_delete(lcur);
 
-  return 0;
+  return status;
 }
+
+#endif
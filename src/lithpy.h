@@ -0,0 +1,68 @@
+#ifndef lithpy_h
+#define lithpy_h
+
+#include <stdbool.h>
+
+/*
+ * Embedding API. Each interpreter is an independent context with its own
+ * parser, environment, ports and statistics, so one context per thread can
+ * run concurrently. A context must only be used by one thread at a time.
+ */
+
+typedef struct lithpy lithpy;
+typedef struct lval lithpy_value;
+typedef struct lenv lithpy_env;
+
+/* Native builtins take ownership of args and return a new value */
+typedef lithpy_value*(*lithpy_builtin)(lithpy_env*, lithpy_value*);
+
+lithpy* lithpy_new(void);
+void lithpy_delete(lithpy* ctx);
+
+/* Results are owned by the caller; errors are returned as error values.
+ * Watched files that changed are reloaded first. */
+lithpy_value* lithpy_eval_string(lithpy* ctx, const char* name, const char* source);
+lithpy_value* lithpy_eval_file(lithpy* ctx, const char* filename);
+
+void lithpy_register(lithpy* ctx, const char* name, lithpy_builtin func);
+
+/*
+ * Limits on each evaluation, zero meaning none. Breaching one stops the
+ * evaluation with a "quota" error, which 'try' doesn't catch. Nearly
+ * exhausting the C stack always does.
+ */
+typedef struct {
+  long heap;      /* Bytes held by values made during it */
+  long steps;     /* Expressions evaluated */
+  long depth;     /* Nested function calls */
+  long time_ms;   /* Wall-clock time */
+} lithpy_limits;
+
+void lithpy_set_limits(lithpy* ctx, lithpy_limits limits);
+
+/* Track values made from now on, listing those never released to stderr on delete */
+void lithpy_heap_profile(lithpy* ctx);
+
+/* Set once the program has called (exit), with the status it asked for */
+bool lithpy_exited(lithpy* ctx, int* status);
+
+/* Values */
+
+lithpy_value* lithpy_number(long x);
+lithpy_value* lithpy_string(const char* s);
+lithpy_value* lithpy_error(const char* msg);
+void lithpy_value_delete(lithpy_value* v);
+
+bool lithpy_is_error(lithpy_value* v);
+bool lithpy_is_number(lithpy_value* v);
+bool lithpy_is_string(lithpy_value* v);
+long lithpy_to_number(lithpy_value* v);
+const char* lithpy_to_string(lithpy_value* v);
+
+/* Printed form of any value, to be freed by the caller */
+char* lithpy_print(lithpy_value* v);
+
+int lithpy_count(lithpy_value* args);
+lithpy_value* lithpy_arg(lithpy_value* args, int i);
+
+#endif
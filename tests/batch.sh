@@ -0,0 +1,23 @@
+# Exit statuses and output of batch mode and files
+
+# Batch mode; 'exit' statuses are taken modulo 256
+expect 0 '(+ 1 2)' -e
+expect 1 '(+ 1 {})' -e
+expect 1 '(+ 1' -e
+expect 3 '(exit 3)' -e
+expect 44 '(exit 300)' -e
+
+# Errors go to stderr after the results printed before them
+order=$(printf '(+ 1 2)\n(+ 1 {})\n' | "$lithpy" -e 2>&1 | head -n 1)
+[ "$order" = 3 ] || fail "lithpy -e printed '$order' first, expected 3"
+
+# Files: an error is printed and later forms run, but the status is 1;
+# 'exit' stops before later files
+echo '(exit 5)' > "$tmp/exit.lspy"
+echo '(+ 1' > "$tmp/parse.lspy"
+echo '(+ 1 {})' > "$tmp/error.lspy"
+echo '(+ 1 2)' > "$tmp/ok.lspy"
+expect 5 '' "$tmp/exit.lspy" "$tmp/parse.lspy"
+expect 1 '' "$tmp/parse.lspy"
+expect 1 '' "$tmp/error.lspy"
+expect 1 '' "$tmp/error.lspy" "$tmp/ok.lspy"
@@ -0,0 +1,45 @@
+# Files are parsed ahead on other threads but evaluated in order
+
+# Each sees the definitions of those before it, however far ahead it was parsed
+echo '(def {v0} 0)' > "$tmp/chain0.lspy"
+chain="$tmp/chain0.lspy"
+i=1
+while [ $i -le 40 ]; do
+  {
+    echo "(def {v$i} (+ v$((i - 1)) 1))"
+    n=0
+    while [ $n -lt 50 ]; do
+      echo "(fun {f$i-$n x} {if (== x 0) {{$i $n \"pad\"}} {f$i-$n (- x 1)}})"
+      n=$((n + 1))
+    done
+  } > "$tmp/chain$i.lspy"
+  chain="$chain $tmp/chain$i.lspy"
+  i=$((i + 1))
+done
+echo '(exit v40)' > "$tmp/chain-end.lspy"
+expect 40 '' $chain "$tmp/chain-end.lspy"
+
+# A parse error in a middle file fails it, and the files after it still run
+echo '(def {a} 3)' > "$tmp/first.lspy"
+echo '(def {b} (+ a' > "$tmp/middle.lspy"
+echo '(exit (+ a 1))' > "$tmp/after.lspy"
+expect 4 '' "$tmp/first.lspy" "$tmp/middle.lspy" "$tmp/after.lspy"
+expect 1 '' "$tmp/first.lspy" "$tmp/middle.lspy" "$tmp/first.lspy"
+
+# 'exit' in an early file stops before the rest, while they are still parsing
+echo '(exit 7)' > "$tmp/early.lspy"
+echo '(exit 9)' > "$tmp/late.lspy"
+expect 7 '' "$tmp/early.lspy" $chain "$tmp/late.lspy"
+
+# A file rewritten by an earlier one runs as rewritten, even at the same size,
+# once the spin has given the workers time to parse it first
+echo '(exit 5)' > "$tmp/target.lspy"
+cat > "$tmp/rewrite.lspy" <<EOF
+(fun {count n} {if (== n 0) {0} {count (- n 1)}})
+(fun {spin n} {if (== n 0) {0} {do (count 1000) (spin (- n 1))}})
+(spin 300)
+(def {p} (open "$tmp/target.lspy" "w"))
+(write p "(exit 6)")
+(close p)
+EOF
+expect 6 '' "$tmp/rewrite.lspy" "$tmp/target.lspy"
@@ -0,0 +1,11 @@
+# A breached quota fails the file
+echo '(fun {loop n} {loop (+ n 1)}) (loop 0)' > "$tmp/loop.lspy"
+expect 1 '' --max-steps 1000 "$tmp/loop.lspy"
+
+# Running out of C stack is a quota error too, whatever the limits
+echo '(fun {deep n} {if (== n 0) {0} {+ 1 (deep (- n 1))}}) (deep 50000)' > "$tmp/deep.lspy"
+expect 1 '' "$tmp/loop.lspy"
+expect 1 '' --timeout 0.5 "$tmp/loop.lspy"
+expect 1 '' --max-steps 100000000 "$tmp/loop.lspy"
+expect 1 '' --no-jit "$tmp/deep.lspy"
+expect 1 '' --no-jit --max-depth 100000 "$tmp/deep.lspy"
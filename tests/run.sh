@@ -0,0 +1,57 @@
+#!/bin/sh
+# Runs each tests/*.lspy after tests/check.lspy, with and without the JIT,
+# and requires both to pass and print the same, then runs the status checks
+# in tests/*.sh. Run from the repository root.
+lithpy=${1:-./lithpy}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+fail() {
+  echo "FAIL $*"
+  failed=1
+}
+
+# expect STATUS INPUT ARGS... runs lithpy ARGS with INPUT on stdin
+expect() {
+  want=$1 input=$2
+  shift 2
+  printf '%s\n' "$input" | "$lithpy" "$@" > /dev/null 2>&1
+  got=$?
+  [ "$got" = "$want" ] || fail "lithpy $* <<< '$input' exited $got, expected $want"
+}
+
+# Paths the scripts may use, defined before they run
+mkfifo "$tmp/fifo"
+cat > "$tmp/paths.lspy" <<EOF
+(def {scratch} "$tmp/scratch")
+(def {fifo} "$tmp/fifo")
+EOF
+
+# run OUTPUT ARGS... runs a script, with a writer waiting on the fifo
+run() {
+  out=$1
+  shift
+  { sleep 1; echo "from the fifo"; } > "$tmp/fifo" &
+  writer=$!
+  "$lithpy" "$@" tests/check.lspy "$tmp/paths.lspy" "$t" > "$out" 2>&1
+  status=$?
+  kill $writer 2> /dev/null
+  return $status
+}
+
+for t in tests/*.lspy; do
+  [ "$t" = tests/check.lspy ] && continue
+  run "$tmp/jit" || { fail "$t"; cat "$tmp/jit"; }
+  run "$tmp/interp" --no-jit || { fail "$t --no-jit"; cat "$tmp/interp"; }
+  cmp -s "$tmp/jit" "$tmp/interp" || { fail "$t differs with --no-jit"; diff "$tmp/jit" "$tmp/interp"; }
+done
+
+# Status checks of each mode, sourced with fail, expect and $tmp defined
+for s in tests/*.sh; do
+  [ "$s" = tests/run.sh ] && continue
+  . "$s"
+done
+
+[ $failed = 0 ] && echo "All tests passed"
+exit $failed
@@ -0,0 +1,14 @@
+# Server: each request's status is passed back to its client
+"$lithpy" --server "$tmp/sock" --workers 1 > "$tmp/server" 2>&1 &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+  [ -S "$tmp/sock" ] && break
+  sleep 0.5
+done
+expect 0 '(+ 1 2)' --client "$tmp/sock"
+expect 1 '(+ 1 {})' --client "$tmp/sock"
+expect 42 '(exit 42)' --client "$tmp/sock"
+expect 44 '(exit 300)' --client "$tmp/sock"
+expect 0 '(+ 1 2)' --client "$tmp/sock"
+kill $server
+wait $server